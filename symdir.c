@@ -23,16 +23,34 @@ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <fnmatch.h>
 #include <getopt.h>
+#include <inttypes.h>
 #include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/xattr.h>
+#include <time.h>
 #include <unistd.h>
 
 #define CHUNKSIZE 4096
+#define PARTITION_MIN  4096 // directories with fewer entries are not split
+#define PARTITION_STEP 256  // number of entries a worker claims at once
+#define JOURNAL_ROTATE (64ul << 20) // journal size at which it is moved to <journal>.1
+#define JOURNAL_HEADER 25
+#define JOURNAL_MAXLEN (1ul << 20)
+#define CHECKPOINT_INTERVAL 10 // seconds between syncs of the checkpoint
+#define XATTR_SOURCE "user.symdir.source" // "<dev> <ino> <path>" of the source directory
+#define TMP_PREFIX ".symdir." // temporary symlinks are named <prefix><pid>.<n>
 #define MAX(a, b)  ((a) ^ (((a) ^ (b)) & -((a) < (b))))
 
 static int verbosity = 0;
@@ -44,8 +62,79 @@ static const char *argv0 = NULL;
 #define WARN(...)   LOG(0, stderr, __VA_ARGS__, 0, "")
 #define ERROR(...)  LOG(0, stderr, __VA_ARGS__, 0, "")
 
+// system calls issued per type, every call site goes through COUNT
+struct stats {
+	unsigned long entries;
+	unsigned long openat;
+	unsigned long fstatat;
+	unsigned long readlinkat;
+	unsigned long mkdirat;
+	unsigned long symlinkat;
+	unsigned long unlinkat;
+	unsigned long renameat;
+	unsigned long fgetxattr;
+	unsigned long fsetxattr;
+};
+#define COUNT_AS(stuff, field, call) ((stuff)->stats.field++, call)
+#define COUNT(stuff, call) COUNT_AS(stuff, call, call)
+
+static const struct {
+	const char *name;
+	size_t      off;
+} statfields[] = {
+	{"openat",     offsetof(struct stats, openat)},
+	{"fstatat",    offsetof(struct stats, fstatat)},
+	{"readlinkat", offsetof(struct stats, readlinkat)},
+	{"mkdirat",    offsetof(struct stats, mkdirat)},
+	{"symlinkat",  offsetof(struct stats, symlinkat)},
+	{"unlinkat",   offsetof(struct stats, unlinkat)},
+	{"renameat",   offsetof(struct stats, renameat)},
+	{"fgetxattr",  offsetof(struct stats, fgetxattr)},
+	{"fsetxattr",  offsetof(struct stats, fsetxattr)},
+};
+#define STATFIELD(st, i) (*(unsigned long *)((char *)(st) + statfields[i].off))
+
+struct collection {
+	const char  *path;
+	int          depth;
+	const char **exclude;
+	size_t       nexclude;
+};
+
+// directory of a collection whose source directory vanished
+struct vanished {
+	char *name;
+	dev_t dev;
+	ino_t ino;
+};
+
+// a collection directory taking part in processing a source directory
+struct target {
+	const struct collection *coll;
+	int                      fd;
+	DIR                     *d;
+	int                      depth;
+	// links below a moved directory still point to the old source path
+	struct {
+		const char *from; // old source path of the moved directory
+		size_t      len;  // length of its new source path
+	} moved;
+	// read on demand when refresh finds a new source directory
+	struct vanished *vanished;
+	size_t           nvanished;
+	int              scanned;
+	// entries of the collection directory if indexed
+	struct dirindex *index;
+};
+// protects the vanished directories of targets shared by workers
+static pthread_mutex_t vanished_lock = PTHREAD_MUTEX_INITIALIZER;
+
 struct asd {
-	const char *coll;
+	const struct collection *coll;
+	int                      jobs;
+	int                      index;
+	struct node             *node; // directory being processed if queued
+	struct stats stats;
 	struct {
 		char  *buf;
 		size_t off;
@@ -65,15 +154,17 @@ struct asd {
 		"",            \
 		(name) ? (name) : ""
 #define COLLPATH(s, name) \
-		(s)->coll                     ? (s)->coll                     : "", \
-		(s)->coll                     ? "/"                           : "", \
+		(s)->coll->path               ? (s)->coll->path               : "", \
+		(s)->coll->path               ? "/"                           : "", \
 		(s)->path.len > (s)->path.off ? (s)->path.buf + (s)->path.off : "", \
 		(s)->path.len > (s)->path.off ? "/"                           : "", \
 		(name)                        ? (name)                        :     \
-				(s)->coll || (s)->path.len > (s)->path.off ? "" : "."
+				(s)->coll->path || (s)->path.len > (s)->path.off ? "" : "."
 
 #define INVALID_SYMLINK_ERROR(stuff, name) \
 		(WARN("invalid symlink '"PATHFMT"': %s", COLLPATH(stuff, name), (stuff)->link.buf), FLAG_WARN)
+#define OTHER_LINK_WARN(stuff, name) \
+		(WARN("'"PATHFMT"' already links to '%s'", COLLPATH(stuff, name), (stuff)->link.buf), FLAG_WARN)
 #define DIR_CONFLICT_ERROR(stuff, name, stdir, stcoll) \
 		(ERROR("'"PATHFMT"' is a %s but '"PATHFMT"' is a %s%s%s",          \
 				DIRPATH((stuff), name),  filetype((stdir).st_mode),  \
@@ -94,7 +185,112 @@ enum {
 	FLAG_RM_NONLINK = 0x10,
 };
 
-typedef int (*command_func)(int, DIR *, int, DIR *, struct asd *, int);
+/*
+journal record, all integers are little endian:
+  u32 crc32 of the rest of the record
+  u32 length of path
+  u64 run id
+  u64 sequence number
+  u8  operation
+      path relative to the collection, prefixed with the collection if
+      several collections are updated, for moves the old and the new
+      path separated by NUL
+*/
+enum {
+	JOURNAL_MKDIR   = 'd',
+	JOURNAL_SYMLINK = 'l',
+	JOURNAL_UNLINK  = 'u',
+	JOURNAL_RMDIR   = 'r',
+	JOURNAL_MOVE    = 'm',
+};
+
+static struct {
+	int             fd;
+	int             prefix; // prefix paths with the collection
+	uint64_t        run;
+	uint64_t        seq;
+	off_t           end;    // size of the valid records
+	pthread_mutex_t lock;
+} journal = {
+	.fd   = -1,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/*
+checkpoint file, all fields are terminated by NUL:
+  "symdir checkpoint" <command>[ <index>/<count>] <source> <collection>... ""
+followed by one record per completed source directory in the order they
+were completed:
+  "<ctime sec> <ctime nsec> <depths> <path relative to source>"
+where depths lists the depth of every collection separated by , or x
+for collections that do not take part in the directory
+*/
+struct checkpoint_entry {
+	const char     *path;
+	const char     *depths;
+	struct timespec ctime;
+	size_t          order;
+	int             state; // 1 if unchanged, -1 if changed, 0 if not yet checked
+};
+
+static struct {
+	FILE                    *fp;
+	time_t                   synced;
+	pthread_mutex_t          lock;
+	char                    *buf;
+	struct checkpoint_entry *ents;
+	size_t                   n;
+} checkpoint = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/*
+With a deadline subdirectories are queued and processed newest source
+ctime first instead of recursively. A directory is complete and recorded
+in the checkpoint once it and all its queued subdirectories are done.
+*/
+struct node {
+	struct node *parent;
+	size_t       refs;   // queued and running subdirectories + 1 while running
+	int          failed;
+	char        *rel;
+	char        *depths;
+	struct stat  st;
+};
+
+struct item {
+	struct timespec ctime;
+	struct node    *parent;
+	char           *dir;  // relative to the source
+	char           *name;
+	struct target  *tgts; // only coll, depth and whether fd is -1 are used
+};
+
+static struct {
+	int             active;
+	struct timespec deadline;
+	pthread_mutex_t lock;
+	struct item    *heap;
+	size_t          n;
+	size_t          len;
+} queue = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/*
+Cooperating processes with --shard=<index>/<count> split the names in the
+source directory and the collections among each other, every process only
+adds and removes the names whose CRC-32 modulo count equals its index.
+*/
+static struct {
+	unsigned long index;
+	unsigned long count;
+} shard = {
+	.index = 0,
+	.count = 1,
+};
+
+typedef int (*command_func)(int, DIR *, struct target *, size_t, struct asd *);
 
 static int is_pdir_cdir(const char *name)
 {
@@ -222,6 +418,580 @@ static int opendirat(DIR **d, int dirfd, const char *path)
 	return fd;
 }
 
+struct namelist {
+	char          *buf;
+	size_t         len;
+	size_t         buflen;
+	size_t        *off;
+	unsigned char *type; // d_type of every name
+	size_t         n;
+	size_t         offlen;
+};
+
+static int read_names(DIR *d, struct namelist *names)
+{
+	const struct dirent *ent;
+	while(errno = 0, (ent = readdir(d)))
+	{
+		const char *name = ent->d_name;
+		if(is_pdir_cdir(name))
+			continue;
+
+		size_t len = strlen(name) + 1;
+		if(names->len + len > names->buflen)
+		{
+			size_t buflen = (names->len + len + CHUNKSIZE - 1) & ~(CHUNKSIZE - 1);
+			buflen = MAX(buflen, 2 * names->buflen);
+			void *tmp = realloc(names->buf, buflen);
+			if(!tmp)
+				return -1;
+			names->buf = tmp, names->buflen = buflen;
+		}
+		if(names->n == names->offlen)
+		{
+			size_t offlen = names->offlen ? 2 * names->offlen : CHUNKSIZE / sizeof(*names->off);
+			void *tmp = realloc(names->off, offlen * sizeof(*names->off));
+			if(!tmp)
+				return -1;
+			names->off = tmp;
+			if(!(tmp = realloc(names->type, offlen)))
+				return -1;
+			names->type = tmp, names->offlen = offlen;
+		}
+		names->type[names->n]  = ent->d_type;
+		names->off[names->n++] = names->len;
+		memcpy(names->buf + names->len, name, len);
+		names->len += len;
+	}
+	return errno ? -1 : 0;
+}
+
+static void free_names(struct namelist *names)
+{
+	free(names->buf);
+	free(names->off);
+	free(names->type);
+}
+
+// hash table over the names of a directory
+struct dirindex {
+	struct namelist names;
+	size_t         *slots; // index into names + 1, 0 if empty
+	size_t          mask;
+};
+
+static size_t hash_name(const char *name)
+{
+	// FNV-1a
+	size_t h = 2166136261u;
+	for(; *name; name++)
+		h = (h ^ (unsigned char)*name) * 16777619u;
+	return h;
+}
+
+static struct dirindex *index_dir(DIR *d)
+{
+	struct dirindex *idx = calloc(1, sizeof(*idx));
+	if(!idx)
+		return NULL;
+	if(read_names(d, &idx->names) < 0)
+		goto error;
+
+	size_t nslots = 16;
+	while(nslots < 2 * idx->names.n)
+		nslots *= 2;
+	if(!(idx->slots = calloc(nslots, sizeof(*idx->slots))))
+		goto error;
+	idx->mask = nslots - 1;
+	for(size_t i = 0; i < idx->names.n; i++)
+	{
+		size_t h = hash_name(idx->names.buf + idx->names.off[i]) & idx->mask;
+		while(idx->slots[h])
+			h = (h + 1) & idx->mask;
+		idx->slots[h] = i + 1;
+	}
+	return idx;
+
+error:
+	free_names(&idx->names);
+	free(idx);
+	return NULL;
+}
+
+// return the d_type of name or -1 if it does not exist
+static int index_lookup(const struct dirindex *idx, const char *name)
+{
+	for(size_t h = hash_name(name) & idx->mask; idx->slots[h]; h = (h + 1) & idx->mask)
+	{
+		size_t i = idx->slots[h] - 1;
+		if(strcmp(idx->names.buf + idx->names.off[i], name) == 0)
+			return idx->names.type[i];
+	}
+	return -1;
+}
+
+static void free_index(struct dirindex *idx)
+{
+	if(!idx)
+		return;
+	free_names(&idx->names);
+	free(idx->slots);
+	free(idx);
+}
+
+static void stats_add(struct stats *dst, const struct stats *src)
+{
+	dst->entries += src->entries;
+	for(size_t i = 0; i < sizeof(statfields) / sizeof(*statfields); i++)
+		STATFIELD(dst, i) += STATFIELD(src, i);
+}
+
+static void print_stats(const struct stats *st)
+{
+	printf("%s: %-10s %lu\n", argv0, "entries", st->entries);
+	for(size_t i = 0; i < sizeof(statfields) / sizeof(*statfields); i++)
+		printf("%s: %-10s %lu %.2f per entry\n", argv0, statfields[i].name,
+				STATFIELD(st, i),
+				st->entries ? (double)STATFIELD(st, i) / st->entries : 0.0);
+}
+
+static uint32_t crc32_table[256];
+
+static void crc32_init(void)
+{
+	for(uint32_t i = 0; i < 256; i++)
+	{
+		uint32_t c = i;
+		for(int k = 0; k < 8; k++)
+			c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+		crc32_table[i] = c;
+	}
+}
+
+static uint32_t crc32_update(uint32_t crc, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	crc = ~crc;
+	while(len-- > 0)
+		crc = crc32_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+static void put_le(unsigned char *buf, uint64_t x, int n)
+{
+	for(int i = 0; i < n; i++, x >>= 8)
+		buf[i] = x & 0xff;
+}
+
+static uint64_t get_le(const unsigned char *buf, int n)
+{
+	uint64_t x = 0;
+	while(n-- > 0)
+		x = x << 8 | buf[n];
+	return x;
+}
+
+static const char *journal_op(int op)
+{
+	switch(op)
+	{
+	case JOURNAL_MKDIR:
+		return "mkdir";
+	case JOURNAL_SYMLINK:
+		return "symlink";
+	case JOURNAL_UNLINK:
+		return "unlink";
+	case JOURNAL_RMDIR:
+		return "rmdir";
+	case JOURNAL_MOVE:
+		return "move";
+	default:
+		return "unknown";
+	}
+}
+
+/*
+Read all valid records of the journal fd. *end is set to the offset
+after the last valid record, *first to the sequence number of the first
+record if it is still 0. If print is set records with a sequence number
+greater than since are printed, it is an error if the first record comes
+after since + 1.
+*/
+static int journal_scan(int fd, uint64_t since, int print, off_t *end, uint64_t *first, uint64_t *run, uint64_t *seq)
+{
+	FILE *fp    = NULL;
+	int   tmpfd = dup(fd);
+	if(tmpfd < 0 || lseek(tmpfd, 0, SEEK_SET) < 0 || !(fp = fdopen(tmpfd, "r")))
+	{
+		int errbak = errno;
+		if(tmpfd >= 0)
+			close(tmpfd);
+		errno = errbak;
+		return -1;
+	}
+
+	unsigned char hdr[JOURNAL_HEADER];
+	char  *path    = NULL;
+	size_t pathlen = 0;
+	int    ret     = 0;
+	*end = 0;
+	// only a last record running past the end of the file is torn, other
+	// damage is not skipped so sequence numbers are never handed out twice
+	while(fread(hdr, sizeof(hdr), 1, fp) == 1)
+	{
+		size_t len = get_le(hdr + 4, 4);
+		if(len >= JOURNAL_MAXLEN)
+			goto corrupt;
+		if(len >= pathlen)
+		{
+			void *tmp = realloc(path, len + 1);
+			if(!tmp)
+			{
+				ret = -1;
+				break;
+			}
+			path = tmp, pathlen = len + 1;
+		}
+		if(len > 0 && fread(path, len, 1, fp) != 1)
+			break;
+		if(get_le(hdr, 4) != crc32_update(crc32_update(0, hdr + 4, sizeof(hdr) - 4), path, len))
+			goto corrupt;
+		path[len] = '\0';
+
+		*run  = get_le(hdr + 8, 8);
+		*seq  = get_le(hdr + 16, 8);
+		*end += sizeof(hdr) + len;
+		if(!*first)
+		{
+			*first = *seq;
+			if(print && *first > since + 1)
+			{
+				ERROR("changes %" PRIu64 " to %" PRIu64 " are no longer in the journal",
+						since + 1, *first - 1);
+				errno = ENODATA;
+				ret = -1;
+				break;
+			}
+		}
+		if(print && *seq > since)
+		{
+			size_t oldlen = strlen(path);
+			printf("%" PRIu64 " %" PRIu64 " %s %s%s%s\n", *seq, *run, journal_op(hdr[24]), path,
+					oldlen < len ? " " : "", oldlen < len ? path + oldlen + 1 : "");
+		}
+	}
+	if(ferror(fp))
+		ret = -1;
+	if(0)
+	{
+	corrupt:
+		ERROR("corrupt journal record at byte %jd", (intmax_t)*end);
+		errno = EBADMSG;
+		ret = -1;
+	}
+
+	int errbak = errno;
+	free(path);
+	fclose(fp);
+	errno = errbak;
+	return ret;
+}
+
+static char *journal_rotated(const char *path)
+{
+	char *rotated = malloc(strlen(path) + 3);
+	if(rotated)
+		strcpy(stpcpy(rotated, path), ".1");
+	return rotated;
+}
+
+static int journal_open(const char *path)
+{
+	crc32_init();
+
+	char *rotated = journal_rotated(path);
+	if(!rotated)
+		return -1;
+
+	int fd;
+	while(1)
+	{
+		fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+		if(fd < 0)
+			goto error;
+		struct stat st, stpath;
+		if(flock(fd, LOCK_EX) < 0 || fstat(fd, &st) < 0)
+			goto error;
+		if(stat(path, &stpath) < 0 || st.st_dev != stpath.st_dev || st.st_ino != stpath.st_ino)
+		{
+			// rotated by somebody else while we waited for the lock
+			close(fd);
+			continue;
+		}
+
+		off_t    end;
+		uint64_t first = 0;
+		uint64_t run   = 0;
+		uint64_t seq   = 0;
+		if(journal_scan(fd, 0, 0, &end, &first, &run, &seq) < 0)
+			goto error;
+		if(end < st.st_size)
+		{
+			WARN("discarding %jd bytes of incomplete records at the end of %s",
+					(intmax_t)(st.st_size - end), path);
+			if(ftruncate(fd, end) < 0)
+				goto error;
+		}
+		if(end == 0)
+		{
+			// continue the numbering of the rotated journal
+			int fdrot = open(rotated, O_RDONLY | O_CLOEXEC);
+			if(fdrot >= 0)
+			{
+				off_t endrot;
+				int   ret = journal_scan(fdrot, 0, 0, &endrot, &first, &run, &seq);
+				close(fdrot);
+				if(ret < 0)
+					goto error;
+			}
+			else if(errno != ENOENT)
+				goto error;
+		}
+		else if(end >= (off_t)JOURNAL_ROTATE)
+		{
+			if(rename(path, rotated) < 0)
+				goto error;
+			close(fd);
+			continue;
+		}
+
+		journal.fd  = fd;
+		journal.run = run + 1;
+		journal.seq = seq;
+		journal.end = end;
+		free(rotated);
+		return 0;
+	}
+
+error:
+	if(fd >= 0)
+	{
+		int errbak = errno;
+		close(fd);
+		errno = errbak;
+	}
+	free(rotated);
+	return -1;
+}
+
+static int journal_close(void)
+{
+	if(journal.fd < 0)
+		return 0;
+	int ret = fsync(journal.fd);
+	if(close(journal.fd) < 0)
+		ret = -1;
+	journal.fd = -1;
+	return ret;
+}
+
+static int journal_print(const char *path, uint64_t since)
+{
+	crc32_init();
+
+	char *rotated = journal_rotated(path);
+	if(!rotated)
+		return -1;
+
+	off_t    end;
+	uint64_t first = 0;
+	uint64_t run   = 0;
+	uint64_t seq   = 0;
+	int      ret   = 0;
+	int fd = open(rotated, O_RDONLY | O_CLOEXEC);
+	if(fd >= 0)
+	{
+		ret = journal_scan(fd, since, 1, &end, &first, &run, &seq);
+		close(fd);
+	}
+	else if(errno != ENOENT)
+		ret = -1;
+	free(rotated);
+	if(ret < 0)
+		return -1;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if(fd < 0)
+		return -1;
+	// wait for a running symdir to finish its records
+	if(flock(fd, LOCK_SH) < 0)
+		ret = -1;
+	else
+		ret = journal_scan(fd, since, 1, &end, &first, &run, &seq);
+	int errbak = errno;
+	close(fd);
+	errno = errbak;
+	return ret;
+}
+
+static char *read_file(const char *path, size_t *len)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if(fd < 0)
+		return NULL;
+	char  *buf    = NULL;
+	size_t buflen = 0;
+	*len = 0;
+	while(1)
+	{
+		if(*len == buflen)
+		{
+			void *tmp = realloc(buf, buflen + CHUNKSIZE * 16);
+			if(!tmp)
+				goto error;
+			buf = tmp, buflen += CHUNKSIZE * 16;
+		}
+		ssize_t n = read(fd, buf + *len, buflen - *len);
+		if(n < 0)
+			goto error;
+		if(n == 0)
+			break;
+		*len += n;
+	}
+	close(fd);
+	return buf;
+
+error:
+	{
+		int errbak = errno;
+		free(buf);
+		close(fd);
+		errno = errbak;
+		return NULL;
+	}
+}
+
+// compare paths so that every directory is directly followed by its descendants
+static int pathcmp(const char *a, const char *b)
+{
+	while(*a && *a == *b)
+		a++, b++;
+	unsigned char ca = *a == '/' ? 1 : *a;
+	unsigned char cb = *b == '/' ? 1 : *b;
+	return (ca > cb) - (ca < cb);
+}
+
+static int checkpoint_entry_cmp(const void *a, const void *b)
+{
+	const struct checkpoint_entry *x = a;
+	const struct checkpoint_entry *y = b;
+	int cmp = pathcmp(x->path, y->path);
+	return cmp ? cmp : (x->order > y->order) - (x->order < y->order);
+}
+
+static int checkpoint_load(const char *path, const char *const *header, size_t nheader)
+{
+	size_t len;
+	char  *buf = read_file(path, &len);
+	if(!buf)
+		return errno == ENOENT ? 0 : -1;
+	checkpoint.buf = buf;
+
+	char *p   = buf;
+	char *end = buf + len;
+	for(size_t i = 0; i <= nheader; i++)
+	{
+		char *q = memchr(p, '\0', end - p);
+		if(!q || strcmp(p, i < nheader ? header[i] : "") != 0)
+		{
+			WARN("ignoring checkpoint %s of a different run", path);
+			return 0;
+		}
+		p = q + 1;
+	}
+
+	size_t n = 0;
+	for(char *q = p; (q = memchr(q, '\0', end - q)); q++)
+		n++;
+	checkpoint.ents = malloc((n ? n : 1) * sizeof(*checkpoint.ents));
+	if(!checkpoint.ents)
+		return -1;
+
+	char *q;
+	while((q = memchr(p, '\0', end - p)))
+	{
+		struct checkpoint_entry *ent = &checkpoint.ents[checkpoint.n];
+		long long sec;
+		long      nsec;
+		int       off = -1;
+		sscanf(p, "%lld %ld %n", &sec, &nsec, &off);
+		char *rel = off < 0 ? NULL : strchr(p + off, ' ');
+		if(!rel)
+			break;
+		*rel++ = '\0';
+		ent->depths        = p + off;
+		ent->path          = rel;
+		ent->ctime.tv_sec  = sec;
+		ent->ctime.tv_nsec = nsec;
+		ent->order         = checkpoint.n++;
+		ent->state         = 0;
+		p = q + 1;
+	}
+	if(p < end)
+	{
+		// drop the incomplete record of an interrupted run
+		WARN("discarding %td bytes of incomplete records at the end of %s", end - p, path);
+		if(truncate(path, p - buf) < 0)
+			return -1;
+	}
+
+	// only the most recent record of every directory counts
+	qsort(checkpoint.ents, checkpoint.n, sizeof(*checkpoint.ents), checkpoint_entry_cmp);
+	n = 0;
+	for(size_t i = 0; i < checkpoint.n; i++)
+	{
+		if(n > 0 && strcmp(checkpoint.ents[n - 1].path, checkpoint.ents[i].path) == 0)
+			n--;
+		checkpoint.ents[n++] = checkpoint.ents[i];
+	}
+	checkpoint.n = n;
+	return 1;
+}
+
+static int checkpoint_open(const char *path, int resume, const char *const *header, size_t nheader)
+{
+	int loaded = 0;
+	if(resume && (loaded = checkpoint_load(path, header, nheader)) < 0)
+		return -1;
+
+	checkpoint.fp = fopen(path, loaded ? "ae" : "we");
+	if(!checkpoint.fp)
+		return -1;
+	if(!loaded)
+		for(size_t i = 0; i <= nheader; i++)
+			if(fputs(i < nheader ? header[i] : "", checkpoint.fp) == EOF
+					|| fputc('\0', checkpoint.fp) == EOF)
+				return -1;
+	checkpoint.synced = time(NULL);
+	return 0;
+}
+
+static int checkpoint_close(void)
+{
+	int ret = 0;
+	if(checkpoint.fp)
+	{
+		if(fflush(checkpoint.fp) == EOF || fsync(fileno(checkpoint.fp)) < 0)
+			ret = -1;
+		if(fclose(checkpoint.fp) == EOF)
+			ret = -1;
+		checkpoint.fp = NULL;
+	}
+	free(checkpoint.ents);
+	free(checkpoint.buf);
+	return ret;
+}
+
 static int growing_getcwd(struct asd *stuff)
 {
 	while(1)
@@ -321,6 +1091,378 @@ static void path_remove(struct asd *stuff, size_t len)
 	stuff->path.buf[len] = '\0';
 }
 
+static const char *relpath(struct asd *stuff)
+{
+	return stuff->path.len > stuff->path.off ? stuff->path.buf + stuff->path.off : "";
+}
+
+static int journal_record(struct asd *stuff, int op, const char *from, const char *name)
+{
+	if(journal.fd < 0)
+		return 0;
+
+	const char *coll = journal.prefix && stuff->coll->path ? stuff->coll->path : "";
+	const char *dir  = relpath(stuff);
+	size_t colllen = strlen(coll);
+	size_t dirlen  = strlen(dir);
+	size_t namelen = strlen(name);
+	int    move    = from != NULL;
+	unsigned char hdr[JOURNAL_HEADER];
+	struct iovec iov[] = {
+		{hdr,                        sizeof(hdr)},
+		{(void *)coll,               move ? colllen : 0},
+		{(void *)"/",                move && colllen ? 1 : 0},
+		{(void *)dir,                move ? dirlen : 0},
+		{(void *)"/",                move && dirlen ? 1 : 0},
+		{(void *)(move ? from : ""), move ? strlen(from) + 1 : 0},
+		{(void *)coll,               colllen},
+		{(void *)"/",                colllen ? 1 : 0},
+		{(void *)dir,                dirlen},
+		{(void *)"/",                dirlen ? 1 : 0},
+		{(void *)name,               namelen},
+	};
+	size_t len = 0;
+	for(size_t i = 1; i < sizeof(iov) / sizeof(*iov); i++)
+		len += iov[i].iov_len;
+	put_le(hdr + 4, len, 4);
+	put_le(hdr + 8, journal.run, 8);
+	hdr[24] = op;
+
+	pthread_mutex_lock(&journal.lock);
+	put_le(hdr + 16, journal.seq + 1, 8);
+	uint32_t crc = crc32_update(0, hdr + 4, sizeof(hdr) - 4);
+	for(size_t i = 1; i < sizeof(iov) / sizeof(*iov); i++)
+		crc = crc32_update(crc, iov[i].iov_base, iov[i].iov_len);
+	put_le(hdr, crc, 4);
+	ssize_t n = writev(journal.fd, iov, sizeof(iov) / sizeof(*iov));
+	if(n == (ssize_t)(sizeof(hdr) + len))
+	{
+		journal.seq++;
+		journal.end += n;
+	}
+	else if(n >= 0)
+	{
+		// a partial record would make the journal unreadable
+		errno = ENOSPC;
+		if(ftruncate(journal.fd, journal.end) < 0)
+		{
+			ERROR("cannot truncate journal, no further changes are recorded: %s", strerror(errno));
+			close(journal.fd);
+			journal.fd = -1;
+		}
+	}
+	pthread_mutex_unlock(&journal.lock);
+
+	if(n != (ssize_t)(sizeof(hdr) + len))
+	{
+		ERROR("cannot write journal record for '"PATHFMT"': %s", COLLPATH(stuff, name), strerror(errno));
+		return FLAG_ERROR;
+	}
+	return 0;
+}
+
+static char *target_depths(const struct target *tgts, size_t n)
+{
+	char *depths = malloc(n * 12 + 1);
+	if(!depths)
+		return NULL;
+	char *p = depths;
+	for(size_t i = 0; i < n; i++)
+	{
+		if(i > 0)
+			*p++ = ',';
+		if(tgts[i].fd == -1)
+			*p++ = 'x';
+		else
+			p += sprintf(p, "%d", tgts[i].depth);
+	}
+	*p = '\0';
+	return depths;
+}
+
+static int checkpoint_record(const char *rel, const struct stat *st, const char *depths)
+{
+	pthread_mutex_lock(&checkpoint.lock);
+	int error = fprintf(checkpoint.fp, "%lld %ld %s %s%c", (long long)st->st_ctim.tv_sec,
+			(long)st->st_ctim.tv_nsec, depths, rel, '\0') < 0;
+	time_t now = time(NULL);
+	if(!error && now >= checkpoint.synced + CHECKPOINT_INTERVAL)
+	{
+		error = fflush(checkpoint.fp) == EOF || fdatasync(fileno(checkpoint.fp)) < 0;
+		checkpoint.synced = now;
+	}
+	pthread_mutex_unlock(&checkpoint.lock);
+
+	if(error)
+	{
+		ERROR("cannot write checkpoint for %s: %s", *rel ? rel : ".", strerror(errno));
+		return FLAG_ERROR;
+	}
+	return 0;
+}
+
+/*
+Check whether the source directory in stuff->path was completed by a
+previous run and neither it nor any directory below it changed since.
+*/
+static int checkpoint_done(struct asd *stuff, const char *depths)
+{
+	if(checkpoint.n == 0)
+		return 0;
+
+	const char *rel = relpath(stuff);
+	size_t lo = 0;
+	size_t hi = checkpoint.n;
+	while(lo < hi)
+	{
+		size_t mid = lo + (hi - lo) / 2;
+		if(pathcmp(checkpoint.ents[mid].path, rel) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if(lo == checkpoint.n || strcmp(checkpoint.ents[lo].path, rel) != 0
+			|| strcmp(checkpoint.ents[lo].depths, depths) != 0)
+		return 0;
+
+	// the source root with a trailing / followed by the path of a descendant
+	size_t rootlen = stuff->path.off;
+	size_t buflen  = 0;
+	char  *buf     = NULL;
+	int    done    = 1;
+	size_t rellen  = strlen(rel);
+	for(size_t i = lo; done && i < checkpoint.n; i++)
+	{
+		struct checkpoint_entry *ent = &checkpoint.ents[i];
+		if(i > lo && rellen > 0 && (strncmp(ent->path, rel, rellen) != 0 || ent->path[rellen] != '/'))
+			break;
+
+		// every directory is only checked once per run
+		pthread_mutex_lock(&checkpoint.lock);
+		int state = ent->state;
+		pthread_mutex_unlock(&checkpoint.lock);
+		if(state != 0)
+		{
+			done = state > 0;
+			continue;
+		}
+
+		size_t len = rootlen + strlen(ent->path) + 1;
+		if(len > buflen)
+		{
+			void *tmp = realloc(buf, len);
+			if(!tmp)
+			{
+				done = 0;
+				break;
+			}
+			buf = tmp, buflen = len;
+		}
+		memcpy(buf, stuff->path.buf, rootlen - 1);
+		buf[rootlen - 1] = '/';
+		strcpy(buf + rootlen, ent->path);
+
+		struct stat st;
+		done = COUNT(stuff, fstatat)(AT_FDCWD, buf, &st, AT_SYMLINK_NOFOLLOW) == 0
+				&& S_ISDIR(st.st_mode)
+				&& st.st_ctim.tv_sec  == ent->ctime.tv_sec
+				&& st.st_ctim.tv_nsec == ent->ctime.tv_nsec;
+		pthread_mutex_lock(&checkpoint.lock);
+		ent->state = done ? 1 : -1;
+		pthread_mutex_unlock(&checkpoint.lock);
+	}
+	free(buf);
+	return done;
+}
+
+// st is the source directory recorded in the checkpoint, NULL without one
+static struct node *node_new(struct asd *stuff, const struct stat *st, char *depths)
+{
+	struct node *node = malloc(sizeof(*node));
+	if(!node || !(node->rel = strdup(relpath(stuff))))
+	{
+		free(node);
+		return NULL;
+	}
+	node->parent = stuff->node;
+	node->refs   = 1;
+	node->failed = 0;
+	node->depths = depths;
+	if(st)
+		node->st = *st;
+	pthread_mutex_lock(&queue.lock);
+	if(node->parent)
+		node->parent->refs++;
+	pthread_mutex_unlock(&queue.lock);
+	return node;
+}
+
+// drop a reference, completed directories are recorded in the checkpoint
+static int node_release(struct node *node, int failed)
+{
+	int flags = 0;
+	pthread_mutex_lock(&queue.lock);
+	while(node)
+	{
+		node->failed |= failed;
+		if(--node->refs > 0)
+			break;
+		failed = node->failed;
+		if(checkpoint.fp && !failed)
+			flags |= checkpoint_record(node->rel, &node->st, node->depths);
+		struct node *parent = node->parent;
+		free(node->rel);
+		free(node->depths);
+		free(node);
+		node = parent;
+	}
+	pthread_mutex_unlock(&queue.lock);
+	return flags;
+}
+
+static int item_newer(const struct item *a, const struct item *b)
+{
+	return a->ctime.tv_sec != b->ctime.tv_sec ? a->ctime.tv_sec > b->ctime.tv_sec
+			: a->ctime.tv_nsec > b->ctime.tv_nsec;
+}
+
+// queue the subdirectory name for the collections in tgts whose fd is not -1
+static int queue_push(struct asd *stuff, const struct target *tgts, size_t n, const char *name, const struct stat *st)
+{
+	struct item item = {
+		.ctime  = st->st_ctim,
+		.parent = stuff->node,
+		.dir    = strdup(relpath(stuff)),
+		.name   = strdup(name),
+		.tgts   = malloc(n * sizeof(*item.tgts)),
+	};
+	if(!item.dir || !item.name || !item.tgts)
+		goto error;
+	for(size_t i = 0; i < n; i++)
+		item.tgts[i] = (struct target){
+			.coll  = tgts[i].coll,
+			.fd    = tgts[i].fd == -1 ? -1 : 0,
+			.depth = tgts[i].depth,
+		};
+
+	pthread_mutex_lock(&queue.lock);
+	if(queue.n == queue.len)
+	{
+		size_t len = queue.len ? 2 * queue.len : CHUNKSIZE / sizeof(*queue.heap);
+		void *tmp = realloc(queue.heap, len * sizeof(*queue.heap));
+		if(!tmp)
+		{
+			pthread_mutex_unlock(&queue.lock);
+			goto error;
+		}
+		queue.heap = tmp, queue.len = len;
+	}
+	size_t i = queue.n++;
+	for(; i > 0 && item_newer(&item, &queue.heap[(i - 1) / 2]); i = (i - 1) / 2)
+		queue.heap[i] = queue.heap[(i - 1) / 2];
+	queue.heap[i] = item;
+	if(item.parent)
+		item.parent->refs++;
+	pthread_mutex_unlock(&queue.lock);
+	return 0;
+
+error:
+	free(item.dir);
+	free(item.name);
+	free(item.tgts);
+	return -1;
+}
+
+// pop the newest queued directory
+static int queue_pop(struct item *item)
+{
+	pthread_mutex_lock(&queue.lock);
+	if(queue.n == 0)
+	{
+		pthread_mutex_unlock(&queue.lock);
+		return 0;
+	}
+	*item = queue.heap[0];
+	struct item last = queue.heap[--queue.n];
+	size_t i = 0;
+	for(size_t child; (child = 2 * i + 1) < queue.n; i = child)
+	{
+		if(child + 1 < queue.n && item_newer(&queue.heap[child + 1], &queue.heap[child]))
+			child++;
+		if(!item_newer(&queue.heap[child], &last))
+			break;
+		queue.heap[i] = queue.heap[child];
+	}
+	queue.heap[i] = last;
+	pthread_mutex_unlock(&queue.lock);
+	return 1;
+}
+
+static int deadline_passed(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec != queue.deadline.tv_sec ? now.tv_sec > queue.deadline.tv_sec
+			: now.tv_nsec >= queue.deadline.tv_nsec;
+}
+
+// whether name in the source directory belongs to another shard
+static int other_shard(struct asd *stuff, const char *name)
+{
+	return shard.count > 1 && stuff->path.len < stuff->path.off
+			&& crc32_update(0, name, strlen(name)) % shard.count != shard.index;
+}
+
+static int excluded(const struct collection *coll, const char *name)
+{
+	for(size_t i = 0; i < coll->nexclude; i++)
+		if(fnmatch(coll->exclude[i], name, 0) == 0)
+			return 1;
+	return 0;
+}
+
+static int add_collection(struct collection **colls, size_t *n, const char *path)
+{
+	void *tmp = realloc(*colls, (*n + 1) * sizeof(**colls));
+	if(!tmp)
+		return -1;
+	*colls = tmp;
+	(*colls)[(*n)++] = (struct collection){
+		.path  = path,
+		.depth = -2,
+	};
+	return 0;
+}
+
+static int add_exclude(struct collection *coll, const char *pattern)
+{
+	void *tmp = realloc(coll->exclude, (coll->nexclude + 1) * sizeof(*coll->exclude));
+	if(!tmp)
+		return -1;
+	coll->exclude = tmp;
+	coll->exclude[coll->nexclude++] = pattern;
+	return 0;
+}
+
+static void free_collections(struct collection *colls, size_t n)
+{
+	for(size_t i = 0; i < n; i++)
+		free(colls[i].exclude);
+	free(colls);
+}
+
+static int path_moved_link(struct asd *stuff, const struct target *tgt, const char *name)
+{
+	size_t      fromlen = strlen(tgt->moved.from);
+	const char *rest    = stuff->path.buf + tgt->moved.len;
+	size_t      restlen = stuff->path.len - tgt->moved.len;
+	const char *link    = stuff->link.buf;
+	return strncmp(link, tgt->moved.from, fromlen) == 0
+			&& strncmp(link + fromlen, rest, restlen) == 0
+			&& link[fromlen + restlen] == '/'
+			&& strcmp(link + fromlen + restlen + 1, name) == 0;
+}
+
 static int path_eq_link(struct asd *stuff, const char *name)
 {
 	return strncmp(stuff->link.buf, stuff->path.buf, stuff->path.len) == 0
@@ -341,7 +1483,7 @@ static int path_valid_link(struct asd *stuff, const char *name)
 static int growing_readlinkat(int dirfd, const char *name, struct asd *stuff)
 {
 	ssize_t len;
-	while(!stuff->link.buf || (len = readlinkat(dirfd, name, stuff->link.buf,
+	while(!stuff->link.buf || (len = COUNT(stuff, readlinkat)(dirfd, name, stuff->link.buf,
 			stuff->link.buflen)) == (ssize_t)stuff->link.buflen)
 	{
 		void *tmp = realloc(stuff->link.buf, stuff->link.buflen + CHUNKSIZE);
@@ -355,51 +1497,194 @@ static int growing_readlinkat(int dirfd, const char *name, struct asd *stuff)
 	return 0;
 }
 
-static int cmd_add    (int, DIR *, int, DIR *, struct asd *, int);
-static int cmd_rm     (int, DIR *, int, DIR *, struct asd *, int);
-static int cmd_refresh(int, DIR *, int, DIR *, struct asd *, int);
+static int growing_fgetxattr(int fd, struct asd *stuff)
+{
+	ssize_t len;
+	while(!stuff->link.buf || (len = COUNT(stuff, fgetxattr)(fd, XATTR_SOURCE, stuff->link.buf,
+			stuff->link.buflen - 1)) < 0)
+	{
+		if(stuff->link.buf && errno != ERANGE)
+			return -1;
+		void *tmp = realloc(stuff->link.buf, stuff->link.buflen + CHUNKSIZE);
+		if(!tmp)
+			return -1;
+		stuff->link.buf = tmp, stuff->link.buflen += CHUNKSIZE;
+	}
+	stuff->link.buf[len] = '\0';
+	return 0;
+}
 
-static int go_deeper(command_func cmd, int fdsrc, int fdsym, const char *name, struct asd *stuff, int depth, const char *namesym)
+// the value of XATTR_SOURCE for the source directory dir/name
+static char *source_tag(const struct stat *st, const char *dir, const char *name)
+{
+	char *tag;
+	if(asprintf(&tag, "%llu %llu %s%s%s", (unsigned long long)st->st_dev,
+			(unsigned long long)st->st_ino, dir, name ? "/" : "", name ? name : "") < 0)
+		return NULL;
+	return tag;
+}
+
+/*
+Tag the collection directory fd with tag of the source directory st,
+directories already tagged for another source directory are tagged
+with - instead. name is the directory below the collection path or NULL.
+*/
+static void tag_dir(int fd, const struct stat *st, const char *tag, const char *name, struct asd *stuff)
+{
+	const char *path = strchr(strchr(tag, ' ') + 1, ' ') + 1;
+	const char *set  = tag;
+	if(growing_fgetxattr(fd, stuff) == 0)
+	{
+		unsigned long long dev, ino;
+		int off = -1;
+		sscanf(stuff->link.buf, "%llu %llu %n", &dev, &ino, &off);
+		if(strcmp(stuff->link.buf, tag) == 0 || strcmp(stuff->link.buf, "-") == 0)
+			return;
+		else if(off < 0 || ((dev != st->st_dev || ino != st->st_ino)
+				&& strcmp(stuff->link.buf + off, path) != 0))
+			set = "-";
+	}
+	else if(errno != ENODATA)
+		return;
+	if(COUNT(stuff, fsetxattr)(fd, XATTR_SOURCE, set, strlen(set), 0) < 0)
+		DEBUG("cannot tag '"PATHFMT"': %s", COLLPATH(stuff, name), strerror(errno));
+}
+
+// tag the directory name for the source directory stdir if created by add
+static void tag_subdir(const struct stat *stdir, int fdsym, const char *name, int created, struct asd *stuff)
+{
+	char *tag = source_tag(stdir, stuff->path.buf, name);
+	int   fd  = tag ? COUNT(stuff, openat)(fdsym, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW) : -1;
+	if(fd >= 0 && !created)
+		tag_dir(fd, stdir, tag, name, stuff);
+	else if(fd < 0 || COUNT(stuff, fsetxattr)(fd, XATTR_SOURCE, tag, strlen(tag), XATTR_CREATE) < 0)
+		DEBUG("cannot tag '"PATHFMT"': %s", COLLPATH(stuff, name), strerror(errno));
+	if(fd >= 0)
+		close(fd);
+	free(tag);
+}
+
+static int cmd_add    (int, DIR *, struct target *, size_t, struct asd *);
+static int cmd_rm     (int, DIR *, struct target *, size_t, struct asd *);
+static int cmd_refresh(int, DIR *, struct target *, size_t, struct asd *);
+
+/*
+Open the directory name in the source and in every collection of parents
+whose fd is not -1 and run cmd on it. If root is set name is the source
+directory and the collection directories are the collections themselves.
+*/
+static int go_deeper(command_func cmd, int fdsrc, const struct target *parents, size_t n, const char *name, struct asd *stuff, int root)
 {
 	size_t off = stuff->path.len;
-	if(!namesym && path_append(stuff, name) < 0)
+	if(!root && path_append(stuff, name) < 0)
 	{
 		ERROR("cannot access '"PATHFMT"': %s", DIRPATH(stuff, name), strerror(errno));
 		return FLAG_ERROR | FLAG_NONEMPTY;
 	}
 
-	int  flags = 0;
-	DIR *dsrc  = NULL;
-	DIR *dsym  = NULL;
+	int            flags  = 0;
+	DIR           *dsrc   = NULL;
+	struct target *tgts   = NULL;
+	char          *depths = NULL;
+	struct node   *parent = stuff->node;
+	struct node   *node   = NULL;
 
+	struct stat stsrc;
 	if(fdsrc != -1)
 	{
-		fdsrc = opendirat(cmd == cmd_rm ? NULL : &dsrc, fdsrc, name);
+		if((checkpoint.fp || checkpoint.n > 0) && !(depths = target_depths(parents, n)))
+		{
+			ERROR("cannot access %s: %s", stuff->path.buf, strerror(errno));
+			fdsrc = -1;
+			goto error;
+		}
+		if(checkpoint_done(stuff, depths))
+		{
+			DEBUG("skipped unchanged %s", stuff->path.buf);
+			goto skip;
+		}
+
+		fdsrc = COUNT_AS(stuff, openat, opendirat)(cmd == cmd_rm ? NULL : &dsrc, fdsrc, name);
 		if(fdsrc < 0)
 		{
 			if(errno == ENOENT)
 				goto skip;
 			ERROR("cannot open %s: %s", stuff->path.buf, strerror(errno));
-			fdsym = -1;
+			goto error;
+		}
+
+		// remember the ctime before any entry is read
+		if(checkpoint.fp && COUNT(stuff, fstatat)(fdsrc, "", &stsrc, AT_EMPTY_PATH) < 0)
+		{
+			ERROR("cannot access %s: %s", stuff->path.buf, strerror(errno));
 			goto error;
 		}
 	}
 
-	if(namesym)
-		name = namesym;
-	fdsym = opendirat(cmd == cmd_add ? NULL : &dsym, fdsym, name);
-	if(fdsym < 0)
+	tgts = malloc(n * sizeof(*tgts));
+	if(!tgts)
 	{
-		if(errno != ENOENT)
-			flags |= FLAG_NONEMPTY;
-		if(namesym)
-			ERROR("cannot open %s: %s", name, strerror(errno));
-		else
-			ERROR("cannot open '"PATHFMT"': %s", COLLPATH(stuff, name), strerror(errno));
+		ERROR("cannot access %s: %s", stuff->path.buf, strerror(errno));
+		flags |= FLAG_NONEMPTY;
 		goto error;
 	}
+	size_t nopen = 0;
+	for(size_t i = 0; i < n; i++)
+	{
+		struct target *tgt = &tgts[i];
+		*tgt = (struct target){
+			.coll  = parents[i].coll,
+			.fd    = -1,
+			.depth = parents[i].depth,
+			.moved = parents[i].moved,
+		};
+		if(parents[i].fd == -1)
+			continue;
 
-	flags = cmd(fdsrc, dsrc, fdsym, dsym, stuff, depth);
+		stuff->coll = tgt->coll;
+		const char *namesym = root ? tgt->coll->path ? tgt->coll->path : "." : name;
+		tgt->fd = COUNT_AS(stuff, openat, opendirat)(cmd == cmd_add && !stuff->index ? NULL : &tgt->d,
+				parents[i].fd, namesym);
+		if(tgt->fd < 0)
+		{
+			if(errno != ENOENT)
+				flags |= FLAG_NONEMPTY;
+			if(root)
+				ERROR("cannot open %s: %s", namesym, strerror(errno));
+			else
+				ERROR("cannot open '"PATHFMT"': %s", COLLPATH(stuff, NULL), strerror(errno));
+			flags |= FLAG_ERROR;
+			continue;
+		}
+		if(stuff->index && cmd != cmd_rm && !(tgt->index = index_dir(tgt->d)))
+		{
+			// without an index every name is looked up on its own
+			DEBUG("cannot index '"PATHFMT"': %s", COLLPATH(stuff, NULL), strerror(errno));
+			rewinddir(tgt->d);
+		}
+		nopen++;
+	}
+
+	if(queue.active && cmd != cmd_rm)
+	{
+		// the checkpoint is written once the queued subdirectories are done
+		if(!(node = node_new(stuff, checkpoint.fp ? &stsrc : NULL, depths)))
+		{
+			ERROR("cannot access %s: %s", stuff->path.buf, strerror(errno));
+			goto error;
+		}
+		depths = NULL;
+		stuff->node = node;
+	}
+	if(nopen > 0)
+		flags |= cmd(fdsrc, dsrc, tgts, n, stuff);
+	if(node)
+	{
+		stuff->node = parent;
+		flags |= node_release(node, flags & (FLAG_ERROR | FLAG_WARN));
+	}
+	else if(checkpoint.fp && fdsrc >= 0 && !(flags & (FLAG_ERROR | FLAG_WARN)))
+		flags |= checkpoint_record(relpath(stuff), &stsrc, depths);
 	if(0)
 	{
 	error:
@@ -411,13 +1696,21 @@ static int go_deeper(command_func cmd, int fdsrc, int fdsym, const char *name, s
 		close(fdsrc);
 		closedir(dsrc);
 	}
-	if(fdsym >= 0)
+	for(size_t i = 0; tgts && i < n; i++)
 	{
-		close(fdsym);
-		closedir(dsym);
+		if(tgts[i].fd >= 0)
+			close(tgts[i].fd);
+		if(tgts[i].d)
+			closedir(tgts[i].d);
+		for(size_t k = 0; k < tgts[i].nvanished; k++)
+			free(tgts[i].vanished[k].name);
+		free(tgts[i].vanished);
+		free_index(tgts[i].index);
 	}
+	free(tgts);
 
 skip:
+	free(depths);
 	path_remove(stuff, off);
 
 	return flags;
@@ -425,10 +1718,15 @@ skip:
 
 static int remove_dir(int fdsym, const char *name, struct asd *stuff)
 {
-	int flags = go_deeper(cmd_rm, -1, fdsym, name, stuff, -1, NULL);
+	struct target tgt = {
+		.coll  = stuff->coll,
+		.fd    = fdsym,
+		.depth = -1,
+	};
+	int flags = go_deeper(cmd_rm, -1, &tgt, 1, name, stuff, 0);
 	if(flags & FLAG_NONEMPTY)
 		(void)KEEP_LINK_MSG(stuff, name);
-	else if(unlinkat(fdsym, name, AT_REMOVEDIR) < 0)
+	else if(COUNT(stuff, unlinkat)(fdsym, name, AT_REMOVEDIR) < 0)
 	{
 		if(errno != ENOENT)
 		{
@@ -437,25 +1735,154 @@ static int remove_dir(int fdsym, const char *name, struct asd *stuff)
 		}
 	}
 	else
+	{
 		INFO("removed '"PATHFMT"'", COLLPATH(stuff, name));
+		flags |= journal_record(stuff, JOURNAL_RMDIR, NULL, name);
+	}
 	return flags;
 }
 
-static int add_symlink(int fdsrc, int fdsym, const char *name, struct asd *stuff, int depth)
+static int make_symlink(int fdsym, const char *name, struct asd *stuff)
+{
+	size_t off = stuff->path.len;
+	int error = path_append(stuff, name) < 0
+			|| COUNT(stuff, symlinkat)(stuff->path.buf, fdsym, name) < 0;
+	path_remove(stuff, off);
+	return error ? -1 : 0;
+}
+
+// atomically replace the symlink name with one to the current path
+static int replace_symlink(int fdsym, const char *name, struct asd *stuff)
+{
+	static unsigned long   ntmp     = 0;
+	static pthread_mutex_t ntmplock = PTHREAD_MUTEX_INITIALIZER;
+	pthread_mutex_lock(&ntmplock);
+	unsigned long n = ntmp++;
+	pthread_mutex_unlock(&ntmplock);
+	char tmp[64];
+	snprintf(tmp, sizeof(tmp), TMP_PREFIX "%ld.%lu", (long)getpid(), n);
+	size_t off = stuff->path.len;
+	int error = path_append(stuff, name) < 0
+			|| COUNT(stuff, symlinkat)(stuff->path.buf, fdsym, tmp) < 0;
+	path_remove(stuff, off);
+	if(!error && COUNT(stuff, renameat)(fdsym, tmp, fdsym, name) < 0)
+	{
+		int err = errno;
+		COUNT(stuff, unlinkat)(fdsym, tmp, 0);
+		errno = err;
+		error = 1;
+	}
+	return error ? -1 : 0;
+}
+
+// collect the directories of tgt whose source directory is gone
+static void scan_vanished(int fdsrc, struct target *tgt, struct asd *stuff)
+{
+	tgt->scanned = 1;
+	rewinddir(tgt->d);
+	const struct dirent *ent;
+	while((ent = readdir(tgt->d)))
+	{
+		const char *name = ent->d_name;
+		if(is_pdir_cdir(name) || (ent->d_type != DT_DIR && ent->d_type != DT_UNKNOWN)
+				|| excluded(tgt->coll, name) || other_shard(stuff, name))
+			continue;
+		struct stat st;
+		if(COUNT(stuff, fstatat)(fdsrc, name, &st, AT_SYMLINK_NOFOLLOW) == 0 || errno != ENOENT)
+			continue;
+
+		int fd = COUNT(stuff, openat)(tgt->fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+		if(fd < 0)
+			continue;
+		unsigned long long dev, ino;
+		int tagged = growing_fgetxattr(fd, stuff) == 0
+				&& sscanf(stuff->link.buf, "%llu %llu", &dev, &ino) == 2;
+		close(fd);
+		if(!tagged)
+			continue;
+
+		void *tmp = realloc(tgt->vanished, (tgt->nvanished + 1) * sizeof(*tgt->vanished));
+		if(!tmp)
+			break;
+		tgt->vanished = tmp;
+		struct vanished *v = &tgt->vanished[tgt->nvanished];
+		if(!(v->name = strdup(name)))
+			break;
+		v->dev = dev;
+		v->ino = ino;
+		tgt->nvanished++;
+	}
+	rewinddir(tgt->d);
+}
+
+/*
+Move the directory of tgt that belonged to the source directory stdir
+before it vanished to name. Returns the old source path of the directory
+or NULL if nothing was moved.
+*/
+static char *move_dir(const struct stat *stdir, int fdsrc, struct target *tgt, const char *name, struct asd *stuff, int *flags)
+{
+	char *old = NULL;
+	pthread_mutex_lock(&vanished_lock);
+	if(!tgt->scanned)
+		scan_vanished(fdsrc, tgt, stuff);
+	for(size_t i = 0; i < tgt->nvanished; i++)
+	{
+		struct vanished *v = &tgt->vanished[i];
+		if(v->name && v->dev == stdir->st_dev && v->ino == stdir->st_ino)
+		{
+			old = v->name;
+			v->name = NULL;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&vanished_lock);
+	if(!old)
+		return NULL;
+
+	// links below the directory are retargeted from the old source path
+	const char *base    = tgt->moved.from ? tgt->moved.from : stuff->path.buf;
+	const char *rest    = stuff->path.buf + (tgt->moved.from ? tgt->moved.len : stuff->path.len);
+	size_t      restlen = stuff->path.len - (rest - stuff->path.buf);
+	char       *from    = malloc(strlen(base) + restlen + strlen(old) + 2);
+	if(from)
+		sprintf(from, "%s%.*s/%s", base, (int)restlen, rest, old);
+	if(!from || COUNT(stuff, renameat)(tgt->fd, old, tgt->fd, name) < 0)
+	{
+		DEBUG("cannot move '"PATHFMT"': %s", COLLPATH(stuff, old), strerror(errno));
+		free(from);
+		free(old);
+		return NULL;
+	}
+	INFO("moved '"PATHFMT"' to '%s'", COLLPATH(stuff, old), name);
+	*flags |= journal_record(stuff, JOURNAL_MOVE, old, name);
+	free(old);
+	return from;
+}
+
+/*
+If from is not NULL directories are moved instead of created if their
+source directory was moved and the old source path is stored in *from.
+*/
+static int add_symlink(const struct stat *stdir, int fdsrc, struct target *tgt, const char *name, struct asd *stuff, char **from)
 {
-	struct stat stdir, stcoll;
-	if(fstatat(fdsrc, name, &stdir, AT_SYMLINK_NOFOLLOW) < 0)
+	int fdsym = tgt->fd;
+	int type  = tgt->index ? index_lookup(tgt->index, name) : DT_UNKNOWN;
+	if(type == DT_LNK && !tgt->moved.from)
 	{
-		if(errno == ENOENT)
-			return 0;
-		ERROR("cannot access '"PATHFMT"': %s", DIRPATH(stuff, name), strerror(errno));
-		return FLAG_ERROR;
+		// indexed symlinks are trusted, refresh checks them when cleaning up
+		DEBUG("'"PATHFMT"' already exists", COLLPATH(stuff, name));
+		return 0;
 	}
-
-	if(growing_readlinkat(fdsym, name, stuff) < 0)
+	struct stat stcoll;
+	if((type != DT_LNK && type != DT_UNKNOWN) || growing_readlinkat(fdsym, name, stuff) < 0)
 	{
-		int exists;
-		if(errno != EINVAL || fstatat(fdsym, name, &stcoll, AT_SYMLINK_NOFOLLOW) < 0)
+		int exists = 1;
+		if(type < 0)
+			exists = 0;
+		else if(type != DT_LNK && type != DT_UNKNOWN)
+			stcoll.st_mode = DTTOIF(type);
+		else if(errno != EINVAL || COUNT(stuff, fstatat)(fdsym, name, &stcoll, AT_SYMLINK_NOFOLLOW) < 0)
 		{
 			if(errno != ENOENT)
 			{
@@ -465,26 +1892,34 @@ static int add_symlink(int fdsrc, int fdsym, const char *name, struct asd *stuff
 			}
 			exists = 0;
 		}
-		else if(S_ISDIR(stdir.st_mode) != S_ISDIR(stcoll.st_mode))
-			return DIR_CONFLICT_ERROR(stuff, name, stdir, stcoll);
-		else
-			exists = 1;
+		if(exists && S_ISDIR(stdir->st_mode) != S_ISDIR(stcoll.st_mode))
+			return DIR_CONFLICT_ERROR(stuff, name, *stdir, stcoll);
 
-		if(S_ISDIR(stdir.st_mode))
+		if(S_ISDIR(stdir->st_mode))
 		{
-			if(depth == 0)
+			if(tgt->depth == 0)
 				return 0;
-			if(!exists)
+			int flags = FLAG_ADD_MKDIR;
+			if(!exists && from)
+				*from = move_dir(stdir, fdsrc, tgt, name, stuff, &flags);
+			if(!exists && !(from && *from))
 			{
-				if(mkdirat(fdsym, name, 0777) < 0)
+				if(COUNT(stuff, mkdirat)(fdsym, name, 0777) < 0)
 				{
 					ERROR("cannot create directory '"PATHFMT"': %s",
 							COLLPATH(stuff, name), strerror(errno));
 					return FLAG_ERROR;
 				}
 				INFO("created directory '"PATHFMT"'", COLLPATH(stuff, name));
+				flags |= journal_record(stuff, JOURNAL_MKDIR, NULL, name);
+				tag_subdir(stdir, fdsym, name, 1, stuff);
+			}
+			else if(!from)
+			{
+				// refresh tags directories when descending into them
+				tag_subdir(stdir, fdsym, name, 0, stuff);
 			}
-			return FLAG_ADD_MKDIR;
+			return flags;
 		}
 		else if(exists)
 		{
@@ -492,19 +1927,15 @@ static int add_symlink(int fdsrc, int fdsym, const char *name, struct asd *stuff
 			ERROR("'"PATHFMT"' is a %s", COLLPATH(stuff, name), filetype(stcoll.st_mode));
 			return FLAG_WARN;
 		}
+		else if(make_symlink(fdsym, name, stuff) < 0)
+		{
+			ERROR("cannot create symlink '"PATHFMT"': %s", COLLPATH(stuff, name), strerror(errno));
+			return FLAG_ERROR;
+		}
 		else
 		{
-			size_t off = stuff->path.len;
-			int error = path_append(stuff, name) < 0
-					|| symlinkat(stuff->path.buf, fdsym, name) < 0;
-			path_remove(stuff, off);
-			if(error)
-			{
-				ERROR("cannot create symlink '"PATHFMT"': %s", COLLPATH(stuff, name), strerror(errno));
-				return FLAG_ERROR;
-			}
 			INFO("created symlink '"PATHFMT"'", COLLPATH(stuff, name));
-			return FLAG_NONEMPTY;
+			return FLAG_NONEMPTY | journal_record(stuff, JOURNAL_SYMLINK, NULL, name);
 		}
 	}
 	else if(path_eq_link(stuff, name))
@@ -513,21 +1944,44 @@ static int add_symlink(int fdsrc, int fdsym, const char *name, struct asd *stuff
 		DEBUG("'"PATHFMT"' already exists", COLLPATH(stuff, name));
 		return 0;
 	}
+	else if(tgt->moved.from && path_moved_link(stuff, tgt, name))
+	{
+		// symlink to the same file before its directory was moved
+		if(replace_symlink(fdsym, name, stuff) < 0)
+		{
+			ERROR("cannot retarget symlink '"PATHFMT"': %s", COLLPATH(stuff, name), strerror(errno));
+			return FLAG_ERROR | FLAG_NONEMPTY;
+		}
+		INFO("retargeted symlink '"PATHFMT"'", COLLPATH(stuff, name));
+		int flags = journal_record(stuff, JOURNAL_UNLINK, NULL, name);
+		return flags | FLAG_NONEMPTY | journal_record(stuff, JOURNAL_SYMLINK, NULL, name);
+	}
 	else if(path_valid_link(stuff, name))
 	{
 		// symlink to another file
-		WARN("'"PATHFMT"' already links to '%s'", COLLPATH(stuff, name), stuff->link.buf);
-		return FLAG_WARN;
+		return OTHER_LINK_WARN(stuff, name);
 	}
 	else
 		return INVALID_SYMLINK_ERROR(stuff, name);
 }
 
-static int rm_symlink(int fdsym, struct asd *stuff, const char *name, struct stat *stcoll, int exists)
+// tgt is the target in refresh, links from before a move count as the same file
+// whether name is a temporary symlink left behind by a process that died
+static int stale_tmp_link(const char *name)
+{
+	long          pid;
+	unsigned long n;
+	int           off = -1;
+	if(sscanf(name, TMP_PREFIX "%ld.%lu%n", &pid, &n, &off) != 2 || name[off] != '\0')
+		return 0;
+	return pid != (long)getpid() && kill(pid, 0) < 0 && errno == ESRCH;
+}
+
+static int rm_symlink(int fdsym, const struct target *tgt, struct asd *stuff, const char *name, struct stat *stcoll, int exists)
 {
 	if(growing_readlinkat(fdsym, name, stuff) < 0)
 	{
-		if(errno != EINVAL || fstatat(fdsym, name, stcoll, AT_SYMLINK_NOFOLLOW) < 0)
+		if(errno != EINVAL || COUNT(stuff, fstatat)(fdsym, name, stcoll, AT_SYMLINK_NOFOLLOW) < 0)
 		{
 			if(errno == ENOENT)
 				return 0;
@@ -544,12 +1998,13 @@ static int rm_symlink(int fdsym, struct asd *stuff, const char *name, struct sta
 		else
 			return FLAG_RM_NONLINK;
 	}
-	else if(path_eq_link(stuff, name))
+	else if(path_eq_link(stuff, name)
+			|| (tgt && tgt->moved.from && path_moved_link(stuff, tgt, name)))
 	{
 		// symlink to the same file
 		if(exists)
 			return KEEP_LINK_MSG(stuff, name);
-		else if(unlinkat(fdsym, name, 0) < 0)
+		else if(COUNT(stuff, unlinkat)(fdsym, name, 0) < 0)
 		{
 			if(errno == ENOENT)
 				return 0;
@@ -559,18 +2014,229 @@ static int rm_symlink(int fdsym, struct asd *stuff, const char *name, struct sta
 		else
 		{
 			INFO("removed '"PATHFMT"'", COLLPATH(stuff, name));
-			return 0;
+			return journal_record(stuff, JOURNAL_UNLINK, NULL, name);
 		}
 	}
 	else if(path_valid_link(stuff, name))
+	{
+		// indexed symlinks were not read when adding
+		if(exists && tgt && tgt->index)
+			return OTHER_LINK_WARN(stuff, name);
 		return KEEP_LINK_MSG(stuff, name);
+	}
+	else if(!exists && stale_tmp_link(name))
+	{
+		// left behind while retargeting, it was never journaled
+		if(COUNT(stuff, unlinkat)(fdsym, name, 0) < 0 && errno != ENOENT)
+		{
+			ERROR("cannot unlink '"PATHFMT"': %s", COLLPATH(stuff, name), strerror(errno));
+			return FLAG_ERROR | FLAG_NONEMPTY;
+		}
+		INFO("removed stale '"PATHFMT"'", COLLPATH(stuff, name));
+		return 0;
+	}
 	else
 		return INVALID_SYMLINK_ERROR(stuff, name);
 }
 
-static int cmd_add(int fdsrc, DIR *dsrc, int fdsym, DIR *dsym, struct asd *stuff, int depth)
+// cmd is run on the directories descended into, cmd_refresh also detects moves
+static int add_entry(command_func cmd, int fdsrc, struct target *tgts, size_t n, const char *name, struct asd *stuff)
+{
+	if(other_shard(stuff, name))
+		return 0;
+	stuff->stats.entries++;
+	struct stat stdir;
+	if(COUNT(stuff, fstatat)(fdsrc, name, &stdir, AT_SYMLINK_NOFOLLOW) < 0)
+	{
+		if(errno == ENOENT)
+			return 0;
+		ERROR("cannot access '"PATHFMT"': %s", DIRPATH(stuff, name), strerror(errno));
+		return FLAG_ERROR;
+	}
+
+	// collections the directory is descended into
+	struct target *sub = NULL;
+	if(S_ISDIR(stdir.st_mode) && !(sub = malloc(n * sizeof(*sub))))
+	{
+		ERROR("cannot access '"PATHFMT"': %s", DIRPATH(stuff, name), strerror(errno));
+		return FLAG_ERROR;
+	}
+
+	int flags = 0;
+	int deeper = 0;
+	for(size_t i = 0; i < n; i++)
+	{
+		struct target *tgt = &tgts[i];
+		int   descend = 0;
+		char *from    = NULL;
+		if(tgt->fd >= 0 && !excluded(tgt->coll, name))
+		{
+			stuff->coll = tgt->coll;
+			descend  = add_symlink(&stdir, fdsrc, tgt, name, stuff, cmd == cmd_refresh ? &from : NULL);
+			flags   |= descend & ~FLAG_ADD_MKDIR;
+			descend &= FLAG_ADD_MKDIR;
+			deeper  |= descend;
+		}
+		if(sub)
+			sub[i] = (struct target){
+				.coll  = tgt->coll,
+				.fd    = descend ? tgt->fd : -1,
+				.depth = MAX(tgt->depth - 1, -1),
+				.moved = {
+					.from = from ? from : tgt->moved.from,
+					.len  = from ? stuff->path.len + 1 + strlen(name) : tgt->moved.len,
+				},
+			};
+	}
+	// links below moved directories are retargeted right away
+	int moved = 0;
+	for(size_t i = 0; sub && i < n; i++)
+		moved |= sub[i].moved.from != NULL;
+	if(deeper && (!queue.active || moved || queue_push(stuff, sub, n, name, &stdir) < 0))
+		flags |= go_deeper(cmd, fdsrc, sub, n, name, stuff, 0);
+	for(size_t i = 0; sub && i < n; i++)
+		if(sub[i].moved.from != tgts[i].moved.from)
+			free((char *)sub[i].moved.from);
+	free(sub);
+	return flags;
+}
+
+struct partition {
+	pthread_mutex_t        lock;
+	command_func           cmd;
+	const struct namelist *names;
+	size_t                 next;
+	int                    fdsrc;
+	struct target         *tgts;
+	size_t                 ntgts;
+};
+
+struct worker {
+	pthread_t         thread;
+	struct partition *part;
+	struct asd        stuff;
+	int               flags;
+};
+
+static void *add_worker(void *arg)
+{
+	struct worker    *w    = arg;
+	struct partition *part = w->part;
+	while(1)
+	{
+		pthread_mutex_lock(&part->lock);
+		size_t i = part->next;
+		size_t n = part->names->n - i;
+		if(n > PARTITION_STEP)
+			n = PARTITION_STEP;
+		part->next += n;
+		pthread_mutex_unlock(&part->lock);
+
+		if(n == 0)
+			break;
+		for(; n > 0; i++, n--)
+			w->flags |= add_entry(part->cmd, part->fdsrc, part->tgts, part->ntgts,
+					part->names->buf + part->names->off[i], &w->stuff);
+	}
+	return NULL;
+}
+
+static int add_partitioned(command_func cmd, int fdsrc, DIR *dsrc, struct target *tgts, size_t n, struct asd *stuff)
+{
+	int flags = 0;
+	struct namelist names = {0};
+	if(read_names(dsrc, &names) < 0)
+	{
+		ERROR("cannot read '"PATHFMT"': %s", DIRPATH(stuff, NULL), strerror(errno));
+		flags |= FLAG_ERROR;
+	}
+
+	struct partition part = {
+		.cmd   = cmd,
+		.names = &names,
+		.fdsrc = fdsrc,
+		.tgts  = tgts,
+		.ntgts = n,
+	};
+	// the calling thread is worker 0, the others only help with huge directories
+	size_t nworkers = 1;
+	if(names.n >= PARTITION_MIN)
+	{
+		nworkers = names.n / PARTITION_STEP;
+		if(nworkers > (size_t)stuff->jobs)
+			nworkers = stuff->jobs;
+	}
+	struct worker *workers = calloc(nworkers, sizeof(*workers));
+	if(!workers || pthread_mutex_init(&part.lock, NULL) != 0)
+	{
+		// fall back to sequential processing
+		free(workers);
+		for(size_t i = 0; i < names.n; i++)
+			flags |= add_entry(cmd, fdsrc, tgts, n, names.buf + names.off[i], stuff);
+		free_names(&names);
+		return flags;
+	}
+
+	workers[0].part  = &part;
+	workers[0].stuff = *stuff;
+	size_t started = 1;
+	for(size_t i = 1; i < nworkers; i++)
+	{
+		struct worker *w = &workers[started];
+		w->part  = &part;
+		w->stuff = (struct asd){
+			.coll  = stuff->coll,
+			.jobs  = 1,
+			.index = stuff->index,
+			.node  = stuff->node,
+			.path = {
+				.buf    = malloc(stuff->path.buflen),
+				.off    = stuff->path.off,
+				.len    = stuff->path.len,
+				.buflen = stuff->path.buflen,
+			},
+		};
+		if(!w->stuff.path.buf)
+			break;
+		memcpy(w->stuff.path.buf, stuff->path.buf, stuff->path.buflen);
+		if(pthread_create(&w->thread, NULL, add_worker, w) != 0)
+		{
+			free(w->stuff.path.buf);
+			break;
+		}
+		started++;
+	}
+	if(started < nworkers)
+		DEBUG("only using %zu of %zu workers for '"PATHFMT"'", started, nworkers,
+				DIRPATH(stuff, NULL));
+
+	// nested directories are not partitioned again while other workers are running
+	workers[0].stuff.jobs = started > 1 ? 1 : stuff->jobs;
+	add_worker(&workers[0]);
+	workers[0].stuff.jobs = stuff->jobs;
+	*stuff = workers[0].stuff;
+	flags |= workers[0].flags;
+
+	for(size_t i = 1; i < started; i++)
+	{
+		pthread_join(workers[i].thread, NULL);
+		flags |= workers[i].flags;
+		stats_add(&stuff->stats, &workers[i].stuff.stats);
+		free(workers[i].stuff.path.buf);
+		free(workers[i].stuff.link.buf);
+	}
+
+	pthread_mutex_destroy(&part.lock);
+	free(workers);
+	free_names(&names);
+	return flags;
+}
+
+static int add_entries(command_func cmd, int fdsrc, DIR *dsrc, struct target *tgts, size_t n, struct asd *stuff)
 {
-	(void)dsym;
+	if(stuff->jobs > 1)
+		return add_partitioned(cmd, fdsrc, dsrc, tgts, n, stuff);
+
 	int flags = 0;
 	const struct dirent *ent;
 	while(errno = 0, (ent = readdir(dsrc)))
@@ -579,12 +2245,7 @@ static int cmd_add(int fdsrc, DIR *dsrc, int fdsym, DIR *dsym, struct asd *stuff
 		if(is_pdir_cdir(name))
 			continue;
 
-		flags |= add_symlink(fdsrc, fdsym, name, stuff, depth);
-		if(flags & FLAG_ADD_MKDIR)
-		{
-			flags &= ~FLAG_ADD_MKDIR;
-			flags |= go_deeper(cmd_add, fdsrc, fdsym, name, stuff, MAX(depth - 1, -1), NULL);
-		}
+		flags |= add_entry(cmd, fdsrc, tgts, n, name, stuff);
 	}
 	if(errno)
 	{
@@ -594,9 +2255,13 @@ static int cmd_add(int fdsrc, DIR *dsrc, int fdsym, DIR *dsym, struct asd *stuff
 	return flags;
 }
 
-static int cmd_rm(int fdsrc, DIR *dsrc, int fdsym, DIR *dsym, struct asd *stuff, int depth)
+static int cmd_add(int fdsrc, DIR *dsrc, struct target *tgts, size_t n, struct asd *stuff)
+{
+	return add_entries(cmd_add, fdsrc, dsrc, tgts, n, stuff);
+}
+
+static int rm_entries(int fdsym, DIR *dsym, struct asd *stuff)
 {
-	(void)fdsrc, (void)dsrc, (void)depth;
 	int flags = 0;
 	const struct dirent *ent;
 	while(errno = 0, (ent = readdir(dsym)))
@@ -605,8 +2270,9 @@ static int cmd_rm(int fdsrc, DIR *dsrc, int fdsym, DIR *dsym, struct asd *stuff,
 		if(is_pdir_cdir(name))
 			continue;
 
+		stuff->stats.entries++;
 		struct stat stcoll;
-		flags |= rm_symlink(fdsym, stuff, name, &stcoll, 0);
+		flags |= rm_symlink(fdsym, NULL, stuff, name, &stcoll, 0);
 		if(flags & FLAG_RM_NONLINK)
 		{
 			flags &= ~FLAG_RM_NONLINK;
@@ -624,41 +2290,40 @@ static int cmd_rm(int fdsrc, DIR *dsrc, int fdsym, DIR *dsym, struct asd *stuff,
 	return flags;
 }
 
-static int cmd_refresh(int fdsrc, DIR *dsrc, int fdsym, DIR *dsym, struct asd *stuff, int depth)
+static int cmd_rm(int fdsrc, DIR *dsrc, struct target *tgts, size_t n, struct asd *stuff)
 {
+	(void)fdsrc, (void)dsrc;
 	int flags = 0;
-	const struct dirent *ent;
-
-	// create links and directories that do not yet exist
-	while(errno = 0, (ent = readdir(dsrc)))
-	{
-		const char *name = ent->d_name;
-		if(is_pdir_cdir(name))
-			continue;
-
-		flags |= add_symlink(fdsrc, fdsym, name, stuff, depth);
-		if(flags & FLAG_ADD_MKDIR)
+	for(size_t i = 0; i < n; i++)
+		if(tgts[i].fd >= 0)
 		{
-			flags &= ~FLAG_ADD_MKDIR;
-			flags |= go_deeper(cmd_add, fdsrc, fdsym, name, stuff, MAX(depth - 1, -1), NULL);
+			stuff->coll = tgts[i].coll;
+			flags |= rm_entries(tgts[i].fd, tgts[i].d, stuff);
 		}
-	}
-	if(errno)
-	{
-		ERROR("cannot read '"PATHFMT"': %s", DIRPATH(stuff, NULL), strerror(errno));
-		flags |= FLAG_ERROR;
-	}
+	return flags;
+}
 
-	// clean up existing links and directories
-	while(errno = 0, (ent = readdir(dsym)))
+static int refresh_entries(int fdsrc, const struct target *tgt, struct asd *stuff)
+{
+	int flags = 0;
+	int fdsym = tgt->fd;
+	const struct collection *coll = stuff->coll;
+	// the names of an indexed directory are not read again
+	const struct namelist *names = tgt->index ? &tgt->index->names : NULL;
+	const struct dirent   *ent   = NULL;
+	size_t i = 0;
+	while(names ? i < names->n : (errno = 0, (ent = readdir(tgt->d)) != NULL))
 	{
-		const char *name = ent->d_name;
-		if(is_pdir_cdir(name))
+		const char *name = names ? names->buf + names->off[i++] : ent->d_name;
+		if(is_pdir_cdir(name) || other_shard(stuff, name))
 			continue;
 
+		stuff->coll = coll;
 		int exists;
 		struct stat stdir;
-		if(fstatat(fdsrc, name, &stdir, AT_SYMLINK_NOFOLLOW) < 0)
+		if(excluded(coll, name))
+			exists = 0;
+		else if(COUNT(stuff, fstatat)(fdsrc, name, &stdir, AT_SYMLINK_NOFOLLOW) < 0)
 		{
 			if(errno == ENOENT)
 				exists = 0;
@@ -672,29 +2337,142 @@ static int cmd_refresh(int fdsrc, DIR *dsrc, int fdsym, DIR *dsym, struct asd *s
 		else
 			exists = 1;
 
+		// existing directories and conflicts were handled when adding
 		struct stat stcoll;
-		flags |= rm_symlink(fdsym, stuff, name, &stcoll, exists);
-		switch(flags & FLAG_RM_NONLINK)
-		{
-			flags &= ~FLAG_RM_NONLINK;
-			if(S_ISDIR(stdir.st_mode) != S_ISDIR(stcoll.st_mode))
-				flags |= DIR_CONFLICT_ERROR(stuff, name, stdir, stcoll);
-			else if(S_ISDIR(stcoll.st_mode))
-				flags |= go_deeper(cmd_refresh, fdsrc, fdsym, name, stuff, -1, NULL);
-			else
-			{
-				// conflicting file exists
-				ERROR("'"PATHFMT"' is a %s", COLLPATH(stuff, name), filetype(stcoll.st_mode));
-				flags |= FLAG_NONEMPTY;
-			}
-		}
+		flags |= rm_symlink(fdsym, tgt, stuff, name, &stcoll, exists);
+		flags &= ~FLAG_RM_NONLINK;
 	}
-	if(errno)
+	if(!names && errno)
 	{
 		ERROR("cannot read '"PATHFMT"': %s", COLLPATH(stuff, NULL), strerror(errno));
 		flags |= FLAG_ERROR | FLAG_NONEMPTY;
 	}
+	return flags;
+}
+
+/*
+Tag the collection directories with device, inode and path of the source
+directory, so they can be moved along when the source directory is moved.
+Directories shared by several source directories are tagged with - and
+never moved. Missing support for extended attributes is not an error.
+*/
+static void tag_dirs(int fdsrc, struct target *tgts, size_t n, struct asd *stuff)
+{
+	struct stat st;
+	char       *tag = NULL;
+	for(size_t i = 0; i < n; i++)
+	{
+		if(tgts[i].fd < 0)
+			continue;
+		if(!tag && (COUNT(stuff, fstatat)(fdsrc, "", &st, AT_EMPTY_PATH) < 0
+				|| !(tag = source_tag(&st, stuff->path.buf, NULL))))
+			return;
+		stuff->coll = tgts[i].coll;
+		tag_dir(tgts[i].fd, &st, tag, NULL, stuff);
+	}
+	free(tag);
+}
+
+static int cmd_refresh(int fdsrc, DIR *dsrc, struct target *tgts, size_t n, struct asd *stuff)
+{
+	tag_dirs(fdsrc, tgts, n, stuff);
+
+	// create links and directories that do not yet exist, move moved directories
+	int flags = add_entries(cmd_refresh, fdsrc, dsrc, tgts, n, stuff);
+
+	// clean up existing links and directories
+	for(size_t i = 0; i < n; i++)
+		if(tgts[i].fd >= 0)
+		{
+			stuff->coll = tgts[i].coll;
+			flags |= refresh_entries(fdsrc, &tgts[i], stuff);
+		}
+
+	return flags;
+}
+
+static void free_item(struct item *item)
+{
+	free(item->dir);
+	free(item->name);
+	free(item->tgts);
+}
+
+/*
+Process queued directories until the queue is empty or the deadline has
+passed. Directories still queued then are reported and left for the
+next run.
+*/
+static int run_queue(command_func cmd, size_t n, struct asd *stuff)
+{
+	int         flags = 0;
+	struct item item;
+	while(queue_pop(&item))
+	{
+		int itemflags = 0;
+		if(deadline_passed())
+		{
+			size_t left = 0;
+			do
+			{
+				WARN("not visited %s%s%s", item.dir, *item.dir ? "/" : "", item.name);
+				node_release(item.parent, 1);
+				free_item(&item);
+				left++;
+			}
+			while(queue_pop(&item));
+			WARN("deadline reached, %zu directories not visited", left);
+			flags |= FLAG_WARN;
+			break;
+		}
+
+		// reopen the parent directories of the queued directory
+		path_remove(stuff, stuff->path.off - 1);
+		int fdsrc = -1;
+		if((*item.dir && path_append(stuff, item.dir) < 0)
+				|| (fdsrc = COUNT_AS(stuff, openat, opendirat)(NULL, AT_FDCWD, stuff->path.buf)) < 0)
+		{
+			if(errno != ENOENT)
+			{
+				ERROR("cannot open %s: %s", stuff->path.buf, strerror(errno));
+				itemflags |= FLAG_ERROR;
+			}
+			goto next;
+		}
+		for(size_t i = 0; i < n; i++)
+		{
+			struct target *tgt = &item.tgts[i];
+			if(tgt->fd == -1)
+				continue;
+			const char *coll = tgt->coll->path ? tgt->coll->path : ".";
+			char *path = malloc(strlen(coll) + strlen(item.dir) + 2);
+			if(path)
+				sprintf(path, "%s%s%s", coll, *item.dir ? "/" : "", item.dir);
+			if(!path || (tgt->fd = COUNT_AS(stuff, openat, opendirat)(NULL, AT_FDCWD, path)) < 0)
+			{
+				if(errno != ENOENT)
+				{
+					ERROR("cannot open %s: %s", path ? path : coll, strerror(errno));
+					itemflags |= FLAG_ERROR;
+				}
+				tgt->fd = -1;
+			}
+			free(path);
+		}
 
+		stuff->node = item.parent;
+		itemflags |= go_deeper(cmd, fdsrc, item.tgts, n, item.name, stuff, 0);
+		stuff->node = NULL;
+		for(size_t i = 0; i < n; i++)
+			if(item.tgts[i].fd >= 0)
+				close(item.tgts[i].fd);
+		close(fdsrc);
+
+	next:
+		flags |= itemflags | node_release(item.parent, itemflags & (FLAG_ERROR | FLAG_WARN));
+		free_item(&item);
+	}
+	free(queue.heap);
 	return flags;
 }
 
@@ -703,26 +2481,60 @@ int main(int argc, char **argv)
 	static const struct option globalopts[] = {
 		{"collection", required_argument, NULL, 'c'},
 		{"help",       no_argument,       NULL, 'h'},
+		{"journal",    required_argument, NULL, 'J'},
+		{"stats",      no_argument,       NULL, 's'},
 		{"verbose",    no_argument,       NULL, 'v'},
 		{NULL, 0, NULL, 0}
 	};
 	static const char globaloptstr[] = "hv";
 
 	static const struct option addopts[] = {
+		{"checkpoint", required_argument, NULL, 'C'},
 		{"collection", required_argument, NULL, 'c'},
+		{"deadline",   required_argument, NULL, 'D'},
 		{"depth",      required_argument, NULL, 'd'},
+		{"exclude",    required_argument, NULL, 'x'},
+		{"help",       no_argument,       NULL, 'h'},
+		{"index",      no_argument,       NULL, 'i'},
+		{"jobs",       required_argument, NULL, 'j'},
+		{"journal",    required_argument, NULL, 'J'},
+		{"resume",     no_argument,       NULL, 'R'},
+		{"shard",      required_argument, NULL, 'P'},
+		{"stats",      no_argument,       NULL, 's'},
+		{"verbose",    no_argument,       NULL, 'v'},
+		{NULL, 0, NULL, 0}
+	};
+	static const char addoptstr[] = "d:hij:vx:";
+
+	static const struct option journalopts[] = {
 		{"help",       no_argument,       NULL, 'h'},
+		{"since",      required_argument, NULL, 'S'},
 		{"verbose",    no_argument,       NULL, 'v'},
 		{NULL, 0, NULL, 0}
 	};
-	static const char addoptstr[] = "d:hv";
+	static const char journaloptstr[] = "hv";
 
 	argv0 = argv[0];
 	command_func cmd;
 	const char  *cmdstr;
-	const char  *coll = NULL;
+	const char  *jpath = NULL;
+	const char  *cpath = NULL;
+	int          resume = 0;
+	uint64_t     since = 0;
 	int          opt;
-	int          depth = -1;
+	int          jobs  = 1;
+	int          index = 0;
+	int          stats = 0;
+
+	/*
+	options given before the first --collection of the command apply to all
+	collections, including the ones given before the command
+	*/
+	struct collection  defaults = {.depth = -1};
+	struct collection *colls    = NULL;
+	size_t             ncolls   = 0;
+	size_t             nglobal  = 0;
+	int                error    = 0;
 
 	int resetenv = !getenv("POSIXLY_CORRECT");
 	if(resetenv && setenv("POSIXLY_CORRECT", "", 0) < 0)
@@ -736,24 +2548,33 @@ int main(int argc, char **argv)
 		switch(opt)
 		{
 		case 'h':
-			printf("usage: %s [-h | --help] [-v | --verbose]... [--collection=<path>]\n"
+			printf("usage: %s [-h | --help] [-v | --verbose]... [--collection=<path>]...\n"
 					"              <command> [<option>]... <dir>\n"
 					"Manage a directory full of symlinks. command must be one of add, refresh, and remove.\n"
 					"\n"
 					"Mandatory arguments to long optionas are mandatory for short options too.\n"
-					"      --collection=<path>    s\n"
+					"      --collection=<path>    use collection <path> instead of ., may be repeated\n"
+					"      --journal=<file>       append all changes to <file>\n"
+					"      --stats                print the number of system calls issued\n"
 					"  -v, --verbose              increase verbosity\n"
 					"  -h, --help                 display this help and exit\n",
 					argv0);
-			return 0;
+			goto done;
 		case 'c':
-			coll = optarg;
+			if(add_collection(&colls, &ncolls, optarg) < 0)
+				goto nomem;
+			break;
+		case 'J':
+			jpath = optarg;
+			break;
+		case 's':
+			stats = 1;
 			break;
 		case 'v':
 			verbosity++;
 			continue;
 		default:
-			return 2;
+			goto usage;
 		}
 
 		// TODO guess last arg and remove POSIXLY_CORRECT environment shenanigans
@@ -761,13 +2582,14 @@ int main(int argc, char **argv)
 
 	if(resetenv)
 		unsetenv("POSIXLY_CORRECT");
+	nglobal = ncolls;
 
 	const struct option *cmdopts;
 	const char *cmdoptstr;
 	if(optind == argc)
 	{
 		ERROR("no command given");
-		return 2;
+		goto usage;
 	}
 	else if(strcmp(argv[optind], "refresh") == 0)
 	{
@@ -784,10 +2606,15 @@ int main(int argc, char **argv)
 		cmd     = cmd_rm,     cmdstr    = "remove";
 		cmdopts = globalopts, cmdoptstr = globaloptstr;
 	}
+	else if(strcmp(argv[optind], "journal") == 0)
+	{
+		cmd     = NULL,        cmdstr    = "journal";
+		cmdopts = journalopts, cmdoptstr = journaloptstr;
+	}
 	else
 	{
 		ERROR("unknown command: %s", argv[optind]);
-		return 2;
+		goto usage;
 	}
 	optind++;
 
@@ -797,48 +2624,162 @@ int main(int argc, char **argv)
 		switch(opt)
 		{
 		case 'h':
-			printf("usage: %s %s [-h | --help] [-v | --verbose]... [--collection=<path>]\n"
+			if(!cmd)
+			{
+				printf("usage: %s journal [-h | --help] [--since=<seq>] <file>\n"
+						"Print the changes recorded in the journal <file>.\n"
+						"\n"
+						"      --since=<seq>          only print changes after sequence number <seq>\n"
+						"  -h, --help                 display this help and exit\n",
+						argv0);
+				goto done;
+			}
+			printf("usage: %s %s [-h | --help] [-v | --verbose]... [--collection=<path>]...\n"
 					"              <command> [<option>]... <dir>\n"
 					"%s\n"
 					"\n"
 					"Mandatory arguments to long optionas are mandatory for short options too.\n"
-					"      --collection=<path>    TODO description\n"
+					"      --collection=<path>    use collection <path> instead of ., may be repeated\n"
 					"%s"
+					"      --journal=<file>       append all changes to <file>\n"
+					"      --stats                print the number of system calls issued\n"
 					"  -v, --verbose              increase verbosity\n"
 					"  -h, --help                 display this help and exit\n",
 					argv0, cmdstr,
 					"TODO description",
-					cmdopts == addopts ? "  -d, --depth=<depth>        set recursion depth, unlimited by default\n" : "");
-			return 0;
+					cmdopts == addopts ? "  -d, --depth=<depth>        set recursion depth, unlimited by default\n"
+					                     "  -x, --exclude=<pattern>    do not add names matching the shell pattern <pattern>\n"
+					                     "  -i, --index                read every collection directory at once, add does not\n"
+					                     "                             report symlinks to other files\n"
+					                     "  -j, --jobs=<jobs>          split huge directories among <jobs> workers\n"
+					                     "      --deadline=<duration>  stop after <duration> seconds, or minutes or hours with\n"
+					                     "                             suffix m or h, newest directories first\n"
+					                     "      --checkpoint=<file>    record completed directories in <file>\n"
+					                     "      --resume               skip directories completed according to the checkpoint\n"
+					                     "      --shard=<index>/<count>\n"
+					                     "                             only handle the names of shard <index> of <count>\n" : "");
+			goto done;
 		case 'c':
-			coll = optarg;
+			if(add_collection(&colls, &ncolls, optarg) < 0)
+				goto nomem;
+			break;
+		case 'J':
+			jpath = optarg;
+			break;
+		case 'C':
+			cpath = optarg;
+			break;
+		case 'R':
+			resume = 1;
+			break;
+		case 's':
+			stats = 1;
+			break;
+		case 'S':
+			errno = 0, since = strtoull(optarg, &end, 0);
+			if(*end || (since == ULLONG_MAX && errno == ERANGE))
+			{
+				ERROR("cannot parse sequence number %s: %s", optarg, strerror(*end ? EINVAL : ERANGE));
+				goto usage;
+			}
 			break;
 		case 'd':
 			ldepth = strtoul(optarg, &end, 0);
 			if(ldepth > INT_MAX || *end)
 			{
 				ERROR("cannot parse depth %s: %s", optarg, strerror(*end ? EINVAL : ERANGE));
-				return 2;
+				goto usage;
+			}
+			(ncolls > nglobal ? &colls[ncolls - 1] : &defaults)->depth = ldepth;
+			break;
+		case 'x':
+			if(add_exclude(ncolls > nglobal ? &colls[ncolls - 1] : &defaults, optarg) < 0)
+				goto nomem;
+			break;
+		case 'j':
+			ldepth = strtoul(optarg, &end, 0);
+			if(ldepth < 1 || ldepth > INT_MAX || *end)
+			{
+				ERROR("cannot parse jobs %s: %s", optarg, strerror(*end || ldepth < 1 ? EINVAL : ERANGE));
+				goto usage;
+			}
+			jobs = ldepth;
+			break;
+		case 'i':
+			index = 1;
+			break;
+		case 'D':
+			ldepth = strtoul(optarg, &end, 0);
+			unsigned long unit = *end == 'h' ? 3600 : *end == 'm' ? 60 : 1;
+			if(*end && strchr("smh", *end))
+				end++;
+			if(*end || ldepth > LONG_MAX / unit)
+			{
+				ERROR("cannot parse deadline %s: %s", optarg, strerror(*end ? EINVAL : ERANGE));
+				goto usage;
+			}
+			clock_gettime(CLOCK_MONOTONIC, &queue.deadline);
+			queue.deadline.tv_sec += ldepth * unit;
+			queue.active = 1;
+			break;
+		case 'P':
+			shard.index = strtoul(optarg, &end, 0);
+			shard.count = end > optarg && *end == '/' ? strtoul(end + 1, &end, 0) : 0;
+			if(*end || shard.count < 1 || shard.index >= shard.count || shard.count > UINT32_MAX)
+			{
+				ERROR("cannot parse shard %s: %s", optarg, strerror(EINVAL));
+				goto usage;
 			}
-			depth = ldepth;
+			crc32_init();
 			break;
 		case 'v':
 			verbosity++;
 			break;
 		default:
-			return 2;
+			goto usage;
 		}
 
 	if(optind + 1 != argc)
 	{
-		ERROR("%s", optind == argc ? "no directory given" : "unexpected trailing arguments");
-		return 2;
+		ERROR("%s", optind == argc ? cmd ? "no directory given" : "no journal given"
+				: "unexpected trailing arguments");
+		goto usage;
+	}
+
+	if(resume && !cpath)
+	{
+		ERROR("--resume requires --checkpoint");
+		goto usage;
+	}
+
+	if(ncolls == 0 && add_collection(&colls, &ncolls, NULL) < 0)
+		goto nomem;
+	for(size_t i = 0; i < ncolls; i++)
+	{
+		if(colls[i].depth == -2)
+			colls[i].depth = defaults.depth;
+		for(size_t k = 0; k < defaults.nexclude; k++)
+			if(add_exclude(&colls[i], defaults.exclude[k]) < 0)
+				goto nomem;
+	}
+
+	if(!cmd)
+	{
+		if(journal_print(argv[optind], since) < 0)
+		{
+			ERROR("cannot read journal %s: %s", argv[optind], strerror(errno));
+			error = 1;
+		}
+		goto done;
 	}
 
-	int error = 0;
 	struct asd stuff = {
-		.coll = coll
+		.coll  = &colls[0],
+		.jobs  = jobs,
+		.index = index,
 	};
+	const char   **header = NULL;
+	struct target *root   = NULL;
 
 	if(prepare_dir_path(&stuff, argv[optind]) < 0)
 	{
@@ -846,21 +2787,84 @@ int main(int argc, char **argv)
 		goto error;
 	}
 
-	INFO("%s %s %s %s", cmdstr, stuff.path.buf,
-			cmd == cmd_refresh ? "in" :
-			cmd == cmd_add     ? "to" :
-			"from",
-			coll ? coll : ".");
+	if(jpath && journal_open(jpath) < 0)
+	{
+		ERROR("cannot open journal %s: %s", jpath, strerror(errno));
+		goto error;
+	}
+
+	journal.prefix = ncolls > 1;
+
+	header = malloc((ncolls + 3) * sizeof(*header));
+	root   = malloc(ncolls * sizeof(*root));
+	if(!header || !root)
+	{
+		ERROR("%s", strerror(errno));
+		goto error;
+	}
+	char cmdshard[64];
+	snprintf(cmdshard, sizeof(cmdshard), "%s %lu/%lu", cmdstr, shard.index, shard.count);
+	header[0] = "symdir checkpoint";
+	header[1] = shard.count > 1 ? cmdshard : cmdstr;
+	header[2] = stuff.path.buf;
+	for(size_t i = 0; i < ncolls; i++)
+	{
+		header[i + 3] = colls[i].path ? colls[i].path : ".";
+		root[i] = (struct target){
+			.coll  = &colls[i],
+			.fd    = AT_FDCWD,
+			.depth = colls[i].depth,
+		};
+		INFO("%s %s %s %s", cmdstr, stuff.path.buf,
+				cmd == cmd_refresh ? "in" :
+				cmd == cmd_add     ? "to" :
+				"from",
+				header[i + 3]);
+	}
+	if(cpath && checkpoint_open(cpath, resume, header, ncolls + 3) < 0)
+	{
+		ERROR("cannot open checkpoint %s: %s", cpath, strerror(errno));
+		goto error;
+	}
 
-	if(go_deeper(cmd, cmd == cmd_rm ? -1 : AT_FDCWD, AT_FDCWD,
-			stuff.path.buf, &stuff, depth, coll ? coll : ".") & (FLAG_ERROR | FLAG_WARN))
+	if((go_deeper(cmd, cmd == cmd_rm ? -1 : AT_FDCWD, root, ncolls, stuff.path.buf, &stuff, 1)
+			| (queue.active ? run_queue(cmd, ncolls, &stuff) : 0)) & (FLAG_ERROR | FLAG_WARN))
 	{
 	error:
 		error = 1;
 	}
 
+	if(checkpoint_close() < 0)
+	{
+		ERROR("cannot write checkpoint %s: %s", cpath, strerror(errno));
+		error = 1;
+	}
+
+	if(journal_close() < 0)
+	{
+		ERROR("cannot write journal %s: %s", jpath, strerror(errno));
+		error = 1;
+	}
+
+	if(stats)
+		print_stats(&stuff.stats);
+
 	free(stuff.path.buf);
 	free(stuff.link.buf);
+	free(header);
+	free(root);
 
+done:
+	free_collections(colls, ncolls);
+	free(defaults.exclude);
 	return error;
+
+nomem:
+	ERROR("%s", strerror(errno));
+	error = 1;
+	goto done;
+
+usage:
+	error = 2;
+	goto done;
 }
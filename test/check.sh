@@ -0,0 +1,121 @@
+#!/bin/sh
+# Run symdir over generated trees with the syscount interposer and fail
+# if a scenario issues more calls per source entry than its budget or if
+# --stats misses calls the interposer saw.
+#
+# usage: check.sh <symdir> <syscount.so>
+
+set -eu
+
+symdir=$(realpath "$1")
+preload=$(realpath "$2")
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+cd "$tmp"
+
+# 10 directories with 30 files and a subdirectory with 10 files each
+for d in 0 1 2 3 4 5 6 7 8 9; do
+	mkdir -p "src/d$d/sub"
+	for f in 0 1 2 3 4 5 6 7 8 9; do
+		: > "src/d$d/a$f"
+		: > "src/d$d/b$f"
+		: > "src/d$d/c$f"
+		: > "src/d$d/sub/e$f"
+	done
+done
+mkdir coll
+
+failed=0
+
+# run <scenario> <command> [<option>]...
+run() {
+	scenario=$1
+	shift
+	rm -f counts
+	SYSCOUNT="$tmp/counts" LD_PRELOAD="$preload" \
+		"$symdir" --stats --collection=coll "$@" > stats 2>&1 || {
+		echo "$scenario: symdir failed"
+		cat stats
+		failed=1
+		return
+	}
+	entries=$(awk '$2 == "entries" { print $3 }' stats)
+
+	# every call --stats reports must match what the interposer saw
+	for call in $(awk '$5 == "per" { print $2 }' stats); do
+		own=$(awk -v c="$call" '$2 == c { print $3 }' stats)
+		seen=$(awk -v c="$call" '$1 == c { print $2 }' counts)
+		if [ "$own" != "$seen" ]; then
+			echo "$scenario: --stats reports $own $call but $seen were issued"
+			failed=1
+		fi
+	done
+
+	# <scenario> <call> <maximum per entry>, 16 calls of slack for the root
+	while read -r s call max; do
+		[ "$s" = "$scenario" ] || continue
+		seen=$(awk -v c="$call" '$1 == c { print $2 }' counts)
+		if ! awk -v n="$seen" -v e="$entries" -v m="$max" 'BEGIN { exit !(n <= m * e + 16) }'; then
+			echo "$scenario: $seen $call for $entries entries exceeds $max per entry"
+			failed=1
+		fi
+	done < "$budgets"
+}
+
+budgets="$tmp/budgets"
+cat > "$budgets" <<EOF
+add-new       openat      0.15
+add-new       fstatat     1
+add-new       readlinkat  1
+add-new       mkdirat     0.05
+add-new       symlinkat   1
+add-new       unlinkat    0
+add-new       fsetxattr   0.05
+add-new       readdir     1.2
+add-again     fstatat     1.05
+add-again     readlinkat  1
+add-again     mkdirat     0
+add-again     symlinkat   0
+add-again     openat      0.15
+add-again     fgetxattr   0.05
+add-again     fsetxattr   0
+add-index     fstatat     1
+add-index     readlinkat  0.05
+add-index     readdir     2.4
+refresh       fstatat     2.2
+refresh       readlinkat  2
+refresh       symlinkat   0
+refresh       unlinkat    0
+refresh       dup         0.1
+refresh       fdopendir   0.1
+refresh       fgetxattr   0.05
+refresh-index readlinkat  1
+refresh-index readdir     2.4
+refresh-move  renameat    0.3
+refresh-move  symlinkat   0.3
+refresh-move  mkdirat     0
+refresh-move  unlinkat    0
+remove        fstatat     0.05
+remove        readlinkat  1.05
+remove        unlinkat    1.05
+EOF
+
+run add-new       add src
+run add-again     add src
+run add-index     add -i src
+run refresh       refresh src
+run refresh-index refresh -i src
+mv src/d0 src/moved
+rm src/moved/a0 src/moved/sub/e0
+run refresh-move  refresh src
+if [ -n "$(find coll -xtype l)" ]; then
+	echo "refresh-move: dangling links left behind"
+	find coll -xtype l
+	failed=1
+fi
+run remove        remove src
+
+if [ "$failed" -ne 0 ]; then
+	exit 1
+fi
+echo "all system call budgets met"
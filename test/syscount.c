@@ -0,0 +1,160 @@
+/*
+LD_PRELOAD interposer counting the file system calls symdir issues
+itself, calls made inside libc are not seen. The counts are appended to
+the file named by $SYSCOUNT when the process exits.
+*/
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+enum {
+	C_OPENAT,
+	C_FSTATAT,
+	C_READLINKAT,
+	C_MKDIRAT,
+	C_SYMLINKAT,
+	C_UNLINKAT,
+	C_RENAMEAT,
+	C_FGETXATTR,
+	C_FSETXATTR,
+	C_DUP,
+	C_FDOPENDIR,
+	C_READDIR,
+	C_N
+};
+
+static const char *const names[C_N] = {
+	"openat",
+	"fstatat",
+	"readlinkat",
+	"mkdirat",
+	"symlinkat",
+	"unlinkat",
+	"renameat",
+	"fgetxattr",
+	"fsetxattr",
+	"dup",
+	"fdopendir",
+	"readdir",
+};
+
+static unsigned long counts[C_N];
+
+// look up the libc function and count the call
+#define NEXT(name, id) \
+		static __typeof__(&name) next; \
+		if(!next) \
+			*(void **)&next = dlsym(RTLD_NEXT, #name); \
+		__atomic_fetch_add(&counts[id], 1, __ATOMIC_RELAXED)
+
+int openat(int dirfd, const char *path, int flags, ...)
+{
+	NEXT(openat, C_OPENAT);
+	mode_t mode = 0;
+	if(flags & (O_CREAT | O_TMPFILE))
+	{
+		va_list ap;
+		va_start(ap, flags);
+		mode = va_arg(ap, mode_t);
+		va_end(ap);
+	}
+	return next(dirfd, path, flags, mode);
+}
+
+int fstatat(int dirfd, const char *path, struct stat *st, int flags)
+{
+	NEXT(fstatat, C_FSTATAT);
+	return next(dirfd, path, st, flags);
+}
+
+// before glibc 2.33 the headers turn fstatat into a call of __fxstatat
+int __fxstatat(int ver, int dirfd, const char *path, struct stat *st, int flags)
+{
+	static int (*next)(int, int, const char *, struct stat *, int);
+	if(!next)
+		*(void **)&next = dlsym(RTLD_NEXT, "__fxstatat");
+	__atomic_fetch_add(&counts[C_FSTATAT], 1, __ATOMIC_RELAXED);
+	return next(ver, dirfd, path, st, flags);
+}
+
+ssize_t readlinkat(int dirfd, const char *path, char *buf, size_t len)
+{
+	NEXT(readlinkat, C_READLINKAT);
+	return next(dirfd, path, buf, len);
+}
+
+int mkdirat(int dirfd, const char *path, mode_t mode)
+{
+	NEXT(mkdirat, C_MKDIRAT);
+	return next(dirfd, path, mode);
+}
+
+int symlinkat(const char *target, int dirfd, const char *path)
+{
+	NEXT(symlinkat, C_SYMLINKAT);
+	return next(target, dirfd, path);
+}
+
+int unlinkat(int dirfd, const char *path, int flags)
+{
+	NEXT(unlinkat, C_UNLINKAT);
+	return next(dirfd, path, flags);
+}
+
+int renameat(int olddirfd, const char *oldpath, int newdirfd, const char *newpath)
+{
+	NEXT(renameat, C_RENAMEAT);
+	return next(olddirfd, oldpath, newdirfd, newpath);
+}
+
+ssize_t fgetxattr(int fd, const char *name, void *value, size_t size)
+{
+	NEXT(fgetxattr, C_FGETXATTR);
+	return next(fd, name, value, size);
+}
+
+int fsetxattr(int fd, const char *name, const void *value, size_t size, int flags)
+{
+	NEXT(fsetxattr, C_FSETXATTR);
+	return next(fd, name, value, size, flags);
+}
+
+int dup(int fd)
+{
+	NEXT(dup, C_DUP);
+	return next(fd);
+}
+
+DIR *fdopendir(int fd)
+{
+	NEXT(fdopendir, C_FDOPENDIR);
+	return next(fd);
+}
+
+// getdents is issued inside libc, readdir calls stand in for it
+struct dirent *readdir(DIR *d)
+{
+	NEXT(readdir, C_READDIR);
+	return next(d);
+}
+
+__attribute__((destructor))
+static void report(void)
+{
+	const char *path = getenv("SYSCOUNT");
+	FILE *fp = path ? fopen(path, "a") : NULL;
+	if(!fp)
+		return;
+	for(int i = 0; i < C_N; i++)
+		fprintf(fp, "%s %lu\n", names[i], counts[i]);
+	fclose(fp);
+}